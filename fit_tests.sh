@@ -15,3 +15,47 @@
 ./src/fit -m grid -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external -c "fit_sphere"
 
 ./src/fit -m gradient -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external -c "fit_sphere" --dx external -y "fit_sphere_dx"
+
+./src/fit -m grid -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external-persistent -c "fit_sphere"
+
+./src/fit -m gradient -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external-persistent -c "fit_sphere" --dx external-persistent -y "fit_sphere_dx"
+
+./src/fit -m grid -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external-persistent -c "fit_sphere --binary" --protocol binary
+
+./src/fit -m gradient -n 10 --lo -10.0 --hi 10.0 -f plugin:./src/libfit_sphere_plugin.so:sphere --dx plugin:./src/libfit_sphere_plugin.so:sphere_dx
+
+./src/fit -m grid -n 10 -g 4 -p 4 -d 4 --lo -10.0 --hi 10.0 -f external-shm -c "fit_sphere --shm"
+
+./src/fit -m random -n 10 -i 500 --lo -10.0 --hi 10.0 -f external-async -c "fit_sphere" --in-flight 64
+
+./src/fit -m random -n 10 -i 500 --lo -10.0 --hi 10.0 -f external -c "fit_sphere" --external-batch 50
+
+./src/fit -m grid -n 2 --lo -10.0 --hi 10.0 -f external-shm -c "fit_sphere_worker --shm" -w 2
+
+./src/fit -m random -n 10 -i 500 --lo -10.0 --hi 10.0 -f external-async -c "fit_sphere" --timeout 5 --penalty 1e9 --speculate 4
+
+./src/fit -m random -n 10 -i 10000 --lo -10.0 --hi 10.0 -f rastrigin --simd scalar
+
+./src/fit -m random -n 10 -i 10000 --lo -10.0 --hi 10.0 -f rastrigin -t 4 --seed 7
+
+./src/fit -m grid -n 10 -g 4 -p 4 --lo -10.0 --hi 10.0 -f sphere --cache 16 --cache-quantum 0.01
+
+./src/fit -m random -n 10 -i 500 --lo -10.0 --hi 10.0 -f sphere --seed 1 --store fit_tests.store --store-tag test
+
+./src/fit -m random -n 10 -i 500 --lo -10.0 --hi 10.0 -f sphere --seed 1 --store fit_tests.store --store-tag test
+
+rm -f fit_tests.store
+
+./src/fit -m grid -n 5 -g 8 -p 4 -d 10 --lo -10.0 --hi 10.0 -f sphere --reuse-radius 0.001
+
+./src/fit -m grid -n 4 -g 6 --lo -10.0 --hi 10.0 -f sphere --seed 2 --checkpoint fit_tests.checkpoint --checkpoint-interval 0
+
+./src/fit -m grid -n 4 -g 12 --lo -10.0 --hi 10.0 -f sphere --resume fit_tests.checkpoint
+
+rm -f fit_tests.checkpoint
+
+./src/fit -m random -n 4 -i 1000 --lo -10.0 --hi 10.0 -f sphere -t 2 --log fit_tests.log
+
+./src/fit_log fit_tests.log --format json | tail -n 1
+
+rm -f fit_tests.log
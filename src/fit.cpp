@@ -14,20 +14,51 @@
  */
 
 #include "fit.hpp"
+#include "fit_plugin.h"
+#include "fit_shm.h"
 #include <algorithm>
 #include <atomic>
 #include <boost/process.hpp>
+#include <cctype>
+#include <cerrno>
 #include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <fstream>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
 #include <random>
+#include <shared_mutex>
+#include <spawn.h>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <thread>
 #include <tuple>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
@@ -37,90 +68,2916 @@ static std::random_device rd;
 thread_local std::default_random_engine rng(rd());
 
 namespace Fit {
-// Test functions
+std::default_random_engine &random_engine() { return rng; }
+
+philox::philox(uint64_t key) : key_{(uint32_t)key, (uint32_t)(key >> 32)} {}
+
+philox::counter philox::operator()(counter c) const {
+  uint32_t k0 = key_[0], k1 = key_[1];
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+    uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+    c = {(uint32_t)(p1 >> 32) ^ c[1] ^ k0, (uint32_t)p1,
+         (uint32_t)(p0 >> 32) ^ c[3] ^ k1, (uint32_t)p0};
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  return c;
+}
+
+// The top 53 bits of each pair of words, so every double in [0, 1) that is
+// a multiple of 2^-53 is equally likely.
+void philox::uniform(uint32_t index, uint32_t pass, uint32_t generation,
+                     double *u, size_t n) const {
+  for (size_t j = 0; j < n; j += 2) {
+    counter r = (*this)({(uint32_t)(j / 2), index, pass, generation});
+    u[j] = ((uint64_t)r[0] << 21 ^ r[1] >> 11) * 0x1.0p-53;
+    if (j + 1 < n)
+      u[j + 1] = ((uint64_t)r[2] << 21 ^ r[3] >> 11) * 0x1.0p-53;
+  }
+}
+
+// One call of run(): tasks are claimed by index, so the threads helping
+// with it never hand the same one out twice.
+struct pool_job {
+  const std::function<void(size_t)> *task;
+  size_t count;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> done{0};
+  std::exception_ptr error;
+  bool claimed() const { return next >= count; }
+};
+
+// A work-stealing scheduler. Each of the pool's threads has a deque of the
+// jobs it started, and threads from outside the pool share one more. A
+// thread takes work from the back of its own deque, which keeps it on the
+// job it started most recently, and otherwise steals from the front of
+// another's, which is where the oldest and usually biggest jobs are. A job
+// stays in its deque until all its tasks are claimed, so any number of
+// threads can work on it at once. Threads waiting in run() for the rest of
+// their job to finish run other tasks meanwhile.
+class pool_state {
+public:
+  explicit pool_state(unsigned threads);
+  ~pool_state();
+  void run(size_t count, const std::function<void(size_t)> &task);
+  unsigned size() const { return threads_.size() + 1; }
+  unsigned idle() const { return threads_.size() - busy_; }
+
+private:
+  struct queue {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<pool_job>> jobs;
+  };
+  unsigned self() const;
+  std::shared_ptr<pool_job> find(unsigned self);
+  bool work_one(pool_job &job);
+  void loop(unsigned self);
+  std::vector<std::unique_ptr<queue>> queues_; // 0 is for outside threads
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::atomic<unsigned> sleeping_{0}; // threads waiting for work
+  std::atomic<unsigned> busy_{0};     // pool threads running tasks
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// The pool, if any, that the calling thread belongs to, and its deque.
+thread_local const pool_state *current_pool = nullptr;
+thread_local unsigned current_queue = 0;
+
+pool_state::pool_state(unsigned threads) {
+  for (unsigned i = 0; i < threads; i++)
+    queues_.push_back(std::make_unique<queue>());
+  for (unsigned i = 1; i < threads; i++)
+    threads_.push_back(std::thread([this, i] { loop(i); }));
+}
+
+pool_state::~pool_state() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (auto &t : threads_)
+    t.join();
+}
+
+unsigned pool_state::self() const {
+  return current_pool == this ? current_queue : 0;
+}
+
+// A job with tasks left to claim: the newest from our own deque, or else
+// the oldest from someone else's. Jobs found with nothing left to claim are
+// dropped on the way.
+std::shared_ptr<pool_job> pool_state::find(unsigned self) {
+  {
+    queue &q = *queues_[self];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    while (!q.jobs.empty() && q.jobs.back()->claimed())
+      q.jobs.pop_back();
+    if (!q.jobs.empty())
+      return q.jobs.back();
+  }
+  for (size_t k = 1; k < queues_.size(); k++) {
+    queue &q = *queues_[(self + k) % queues_.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    while (!q.jobs.empty() && q.jobs.front()->claimed())
+      q.jobs.pop_front();
+    if (!q.jobs.empty())
+      return q.jobs.front();
+  }
+  return nullptr;
+}
+
+// Claims and runs one task of job. Returns false if there were none left.
+bool pool_state::work_one(pool_job &job) {
+  size_t i = job.next++;
+  if (i >= job.count)
+    return false;
+  try {
+    (*job.task)(i);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!job.error)
+      job.error = std::current_exception();
+  }
+  if (job.done.fetch_add(1) + 1 == job.count && sleeping_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_all();
+  }
+  return true;
+}
+
+void pool_state::loop(unsigned self) {
+  current_pool = this;
+  current_queue = self;
+  for (;;) {
+    std::shared_ptr<pool_job> job = find(self);
+    if (!job) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      sleeping_++;
+      while (!stopping_ && !(job = find(self)))
+        wake_.wait(lock);
+      sleeping_--;
+      if (!job)
+        return;
+    }
+    busy_++;
+    while (work_one(*job))
+      ;
+    busy_--;
+  }
+}
+
+void pool_state::run(size_t count, const std::function<void(size_t)> &task) {
+  auto job = std::make_shared<pool_job>();
+  job->task = &task;
+  job->count = count;
+  unsigned me = self();
+  {
+    queue &q = *queues_[me];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.jobs.push_back(job);
+  }
+  // A thread counts itself in sleeping_ before its last look for work, so
+  // if that look missed the job, we see it here.
+  if (sleeping_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_.notify_all();
+  }
+  while (work_one(*job))
+    ;
+  // Help with other work until the tasks other threads claimed are done.
+  while (job->done < job->count) {
+    std::shared_ptr<pool_job> other = find(me);
+    if (other) {
+      work_one(*other);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_++;
+    while (job->done < job->count && !(other = find(me)))
+      wake_.wait(lock);
+    sleeping_--;
+  }
+  if (job->error)
+    std::rethrow_exception(job->error);
+}
+
+incumbent::incumbent(size_t n, double initial)
+    : value_(initial), x_(new std::atomic<double>[n]), n_(n) {
+  for (size_t i = 0; i < n; i++)
+    x_[i].store(0.0, std::memory_order_relaxed);
+}
+
+bool incumbent::offer(double y, const double *x) {
+  if (!(y < value()))
+    return false;
+  // An odd sequence number means a writer is busy.
+  unsigned s = sequence_.load(std::memory_order_relaxed);
+  for (;;) {
+    if (s & 1) {
+      s = sequence_.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (sequence_.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+      break;
+  }
+  bool better = y < value_.load(std::memory_order_relaxed);
+  if (better) {
+    for (size_t i = 0; i < n_; i++)
+      x_[i].store(x[i], std::memory_order_relaxed);
+    value_.store(y, std::memory_order_release);
+  }
+  sequence_.store(s + 2, std::memory_order_release);
+  return better;
+}
+
+std::pair<double, std::vector<double>> incumbent::get() const {
+  std::pair<double, std::vector<double>> result;
+  result.second.resize(n_);
+  for (;;) {
+    unsigned s = sequence_.load(std::memory_order_acquire);
+    if (s & 1)
+      continue;
+    result.first = value_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < n_; i++)
+      result.second[i] = x_[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) == s)
+      return result;
+  }
+}
+
+thread_pool::thread_pool(unsigned threads)
+    : state_(std::make_shared<pool_state>(std::max(threads, 1u))) {}
+
+unsigned thread_pool::size() const { return state_->size(); }
+
+unsigned thread_pool::idle() const { return state_->idle(); }
+
+void thread_pool::run(size_t count, const std::function<void(size_t)> &task) {
+  if (count == 0)
+    return;
+  if (count == 1 || size() == 1) {
+    for (size_t i = 0; i < count; i++)
+      task(i);
+    return;
+  }
+  state_->run(count, task);
+}
+
+// Whether a value is worth remembering. NaN from a failed reply, or the
+// penalty of an evaluation that timed out, would only replay a failure that
+// may well not happen again.
+static bool remembered(double y, double penalty) {
+  return !std::isnan(y) && y != penalty;
+}
+
+class cache_state {
+public:
+  cache_state(size_t bytes, size_t n, double quantum, double penalty);
+  typedef std::vector<uint64_t> key;
+  struct key_hash {
+    size_t operator()(const key &k) const;
+  };
+  struct entry {
+    key k;
+    std::shared_future<double> value;
+    uint64_t id; // tells a failed evaluation's entry from a later one
+  };
+  struct shard {
+    std::mutex mutex;
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+    uint64_t next_id = 0;
+  };
+  key make_key(const double *x, size_t n) const;
+  shard &shard_for(const key &k) {
+    return shards_[key_hash()(k) % shards_.size()];
+  }
+  bool find(shard &s, const key &k, std::shared_future<double> &value);
+  void add(shard &s, key k, std::shared_future<double> value, uint64_t id);
+  void forget(shard &s, const key &k, uint64_t id);
+  std::vector<shard> shards_;
+  size_t per_shard_;
+  double quantum_;
+  double penalty_;
+  std::atomic<unsigned> hits_{0};
+  std::atomic<unsigned> misses_{0};
+};
+
+cache_state::cache_state(size_t bytes, size_t n, double quantum,
+                         double penalty)
+    : quantum_(quantum), penalty_(penalty) {
+  // Each entry holds its key twice, in the list and in the index, besides
+  // the nodes and the shared state of the future.
+  size_t entries = std::max<size_t>(bytes / (2 * n * sizeof(double) + 192), 1);
+  shards_ = std::vector<shard>(std::min<size_t>(entries, 64));
+  per_shard_ = entries / shards_.size();
+}
+
+size_t cache_state::key_hash::operator()(const key &k) const {
+  uint64_t h = 0xcbf29ce484222325;
+  for (uint64_t word : k) {
+    h ^= word;
+    h *= 0x100000001b3;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+cache_state::key cache_state::make_key(const double *x, size_t n) const {
+  key k(n);
+  for (size_t i = 0; i < n; i++) {
+    double v = quantum_ > 0.0 ? std::round(x[i] / quantum_) : x[i];
+    std::memcpy(&k[i], &v, sizeof v);
+  }
+  return k;
+}
+
+// Looks k up under the shard's lock, marking it as just used.
+bool cache_state::find(shard &s, const key &k,
+                       std::shared_future<double> &value) {
+  auto it = s.index.find(k);
+  if (it == s.index.end())
+    return false;
+  s.lru.splice(s.lru.begin(), s.lru, it->second);
+  value = it->second->value;
+  return true;
+}
+
+// Adds k under the shard's lock, evicting the least recently used entries
+// if the shard is full. Threads waiting for an evicted value still get it
+// through their copies of the future.
+void cache_state::add(shard &s, key k, std::shared_future<double> value,
+                      uint64_t id) {
+  s.lru.push_front({k, value, id});
+  s.index.emplace(std::move(k), s.lru.begin());
+  while (s.index.size() > per_shard_) {
+    s.index.erase(s.lru.back().k);
+    s.lru.pop_back();
+  }
+}
+
+// Drops the entry for k, if it is still the one added with id.
+void cache_state::forget(shard &s, const key &k, uint64_t id) {
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.index.find(k);
+  if (it != s.index.end() && it->second->id == id) {
+    s.lru.erase(it->second);
+    s.index.erase(it);
+  }
+}
+
+eval_cache::eval_cache(size_t bytes, size_t n, double quantum, double penalty)
+    : state_(std::make_shared<cache_state>(bytes, n, quantum, penalty)) {}
+
+double eval_cache::evaluate(const double *x, size_t n,
+                            const opt_func_ptr &func) {
+  auto k = state_->make_key(x, n);
+  auto &s = state_->shard_for(k);
+  std::promise<double> promise;
+  uint64_t id;
+  {
+    std::unique_lock<std::mutex> lock(s.mutex);
+    std::shared_future<double> value;
+    if (state_->find(s, k, value)) {
+      lock.unlock();
+      state_->hits_++;
+      return value.get();
+    }
+    id = s.next_id++;
+    state_->add(s, k, promise.get_future().share(), id);
+  }
+  state_->misses_++;
+  try {
+    double y = func(x, n);
+    promise.set_value(y);
+    if (!remembered(y, state_->penalty_))
+      state_->forget(s, k, id);
+    return y;
+  } catch (...) {
+    // The threads already waiting get the exception too, but the point
+    // isn't remembered as failing.
+    promise.set_exception(std::current_exception());
+    state_->forget(s, k, id);
+    throw;
+  }
+}
+
+bool eval_cache::find(const double *x, size_t n, double &y) {
+  auto k = state_->make_key(x, n);
+  auto &s = state_->shard_for(k);
+  std::shared_future<double> value;
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!state_->find(s, k, value)) {
+      state_->misses_++;
+      return false;
+    }
+  }
+  state_->hits_++;
+  y = value.get();
+  return true;
+}
+
+void eval_cache::insert(const double *x, size_t n, double y) {
+  if (!remembered(y, state_->penalty_))
+    return;
+  auto k = state_->make_key(x, n);
+  auto &s = state_->shard_for(k);
+  std::promise<double> promise;
+  promise.set_value(y);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (s.index.count(k) == 0)
+    state_->add(s, k, promise.get_future().share(), s.next_id++);
+}
+
+unsigned eval_cache::hits() const { return state_->hits_; }
+
+unsigned eval_cache::misses() const { return state_->misses_; }
+
+// The store's file is a header followed by records, each a record header,
+// the n variables of the point and the value. end in the header is the
+// size of the records written in full, and is only moved on, with the file
+// locked, once a record is.
+class store_file {
+public:
+  store_file(const std::string &path, const std::string &identity);
+  ~store_file();
+  enum state { found, busy, claimed };
+  enum kind : uint32_t { value = 1, claim = 2, release = 3 };
+  state lookup(const double *x, size_t n, double &y);
+  void add(kind k, const double *xs, size_t m, size_t n, const double *ys);
+  std::atomic<unsigned> hits{0};
+  std::atomic<unsigned> misses{0};
+
+private:
+  struct header {
+    char magic[8];
+    uint64_t end;
+    char pad[48];
+  };
+  struct record {
+    uint32_t kind;
+    uint32_t n;
+    uint64_t identity;
+    uint64_t owner;
+  };
+  // What the records so far say about a point.
+  struct entry {
+    size_t offset; // of its first record
+    uint32_t kind;
+    double y;
+    uint64_t owner;
+  };
+  static uint64_t hash(const void *data, size_t size,
+                       uint64_t h = 0xcbf29ce484222325);
+  void refresh();
+  entry *find(const double *x, size_t n);
+  state check(const double *x, size_t n, double &y);
+  void write(kind k, const double *xs, size_t m, size_t n, const double *ys);
+  std::string path_;
+  int fd_ = -1;
+  char *map_ = nullptr;
+  size_t mapped_ = 0;
+  size_t scanned_ = sizeof(header);
+  uint64_t identity_;
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, std::vector<entry>> index_;
+};
+
+// FNV-1a.
+uint64_t store_file::hash(const void *data, size_t size, uint64_t h) {
+  auto bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    h ^= bytes[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+store_file::store_file(const std::string &path, const std::string &identity)
+    : path_(path), identity_(hash(identity.data(), identity.size())) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("can't open evaluation store " + path);
+  flock(fd_, LOCK_EX);
+  struct stat st;
+  bool ok = fstat(fd_, &st) == 0;
+  header h = {};
+  if (ok && st.st_size == 0) {
+    std::memcpy(h.magic, "FITSTORE", sizeof h.magic);
+    h.end = sizeof h;
+    ok = pwrite(fd_, &h, sizeof h, 0) == sizeof h;
+  } else if (ok) {
+    ok = pread(fd_, &h, sizeof h, 0) == sizeof h &&
+         std::memcmp(h.magic, "FITSTORE", sizeof h.magic) == 0;
+  }
+  flock(fd_, LOCK_UN);
+  if (!ok) {
+    close(fd_);
+    throw std::runtime_error(path + " is not an evaluation store");
+  }
+}
+
+store_file::~store_file() {
+  if (map_)
+    munmap(map_, mapped_);
+  close(fd_);
+}
+
+// Indexes the records written since the last call, mapping more of the
+// file first if it has grown. The caller holds mutex_.
+void store_file::refresh() {
+  uint64_t end = sizeof(header);
+  if (map_)
+    end = __atomic_load_n(&reinterpret_cast<header *>(map_)->end,
+                          __ATOMIC_ACQUIRE);
+  if (!map_ || end > mapped_) {
+    struct stat st;
+    if (fstat(fd_, &st) != 0)
+      throw std::runtime_error("can't read evaluation store " + path_);
+    void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd_, 0);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("can't map evaluation store " + path_);
+    if (map_)
+      munmap(map_, mapped_);
+    map_ = static_cast<char *>(p);
+    mapped_ = st.st_size;
+    end = __atomic_load_n(&reinterpret_cast<header *>(map_)->end,
+                          __ATOMIC_ACQUIRE);
+  }
+  while (scanned_ + sizeof(record) <= end) {
+    auto r = reinterpret_cast<const record *>(map_ + scanned_);
+    auto x = reinterpret_cast<const double *>(r + 1);
+    if (scanned_ + sizeof(record) + (r->n + 1) * sizeof(double) > end)
+      throw std::runtime_error(path_ + " is corrupt");
+    if (r->identity == identity_) {
+      entry *e = find(x, r->n);
+      if (!e) {
+        auto &bucket = index_[hash(x, r->n * sizeof(double))];
+        bucket.push_back({scanned_, r->kind, x[r->n], r->owner});
+      } else if (e->kind != value) {
+        // A value, once there is one, is final.
+        e->kind = r->kind;
+        e->y = x[r->n];
+        e->owner = r->owner;
+      }
+    }
+    scanned_ += sizeof(record) + (r->n + 1) * sizeof(double);
+  }
+}
+
+store_file::entry *store_file::find(const double *x, size_t n) {
+  auto it = index_.find(hash(x, n * sizeof(double)));
+  if (it == index_.end())
+    return nullptr;
+  for (auto &e : it->second) {
+    auto r = reinterpret_cast<const record *>(map_ + e.offset);
+    if (r->n == n && std::memcmp(r + 1, x, n * sizeof(double)) == 0)
+      return &e;
+  }
+  return nullptr;
+}
+
+// found with y set, busy if a live process has claimed x, otherwise
+// claimed, meaning x is free to claim. The caller holds mutex_.
+store_file::state store_file::check(const double *x, size_t n, double &y) {
+  refresh();
+  entry *e = find(x, n);
+  if (e && e->kind == value) {
+    y = e->y;
+    return found;
+  }
+  if (e && e->kind == claim &&
+      (kill(e->owner, 0) == 0 || errno == EPERM))
+    return busy;
+  return claimed;
+}
+
+// Looks x up, and claims it for this process if nobody has it.
+store_file::state store_file::lookup(const double *x, size_t n, double &y) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  state s = check(x, n, y);
+  if (s == claimed) {
+    // Check again with the file locked, in case another process got there
+    // first.
+    flock(fd_, LOCK_EX);
+    s = check(x, n, y);
+    if (s == claimed) {
+      try {
+        write(claim, x, 1, n, nullptr);
+      } catch (...) {
+        flock(fd_, LOCK_UN);
+        throw;
+      }
+    }
+    flock(fd_, LOCK_UN);
+  }
+  if (s == found)
+    hits++;
+  if (s == claimed)
+    misses++;
+  return s;
+}
+
+// Appends a record for each of the m rows of xs, with the values in ys if
+// k is value.
+void store_file::add(kind k, const double *xs, size_t m, size_t n,
+                     const double *ys) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  flock(fd_, LOCK_EX);
+  try {
+    write(k, xs, m, n, ys);
+  } catch (...) {
+    flock(fd_, LOCK_UN);
+    throw;
+  }
+  flock(fd_, LOCK_UN);
+}
+
+// The caller holds mutex_ and the file lock.
+void store_file::write(kind k, const double *xs, size_t m, size_t n,
+                       const double *ys) {
+  std::string bytes;
+  for (size_t i = 0; i < m; i++) {
+    record r = {k, (uint32_t)n, identity_, (uint64_t)getpid()};
+    bytes.append(reinterpret_cast<const char *>(&r), sizeof r);
+    bytes.append(reinterpret_cast<const char *>(xs + i * n),
+                 n * sizeof(double));
+    double y = k == value ? ys[i] : NAN;
+    bytes.append(reinterpret_cast<const char *>(&y), sizeof y);
+  }
+  refresh();
+  auto h = reinterpret_cast<header *>(map_);
+  uint64_t end = __atomic_load_n(&h->end, __ATOMIC_ACQUIRE);
+  size_t written = 0;
+  while (written < bytes.size()) {
+    ssize_t w = pwrite(fd_, bytes.data() + written, bytes.size() - written,
+                       end + written);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      throw std::runtime_error("can't write evaluation store " + path_);
+    written += w;
+  }
+  __atomic_store_n(&h->end, end + bytes.size(), __ATOMIC_RELEASE);
+  refresh();
+}
+
+eval_store::eval_store(const std::string &path, const std::string &identity,
+                       double penalty)
+    : file_(std::make_shared<store_file>(path, identity)), penalty_(penalty) {}
+
+double eval_store::evaluate(const double *x, size_t n,
+                            const opt_func_ptr &func) {
+  double y;
+  store_file::state s;
+  while ((s = file_->lookup(x, n, y)) == store_file::busy)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  if (s == store_file::found)
+    return y;
+  try {
+    y = func(x, n);
+  } catch (...) {
+    file_->add(store_file::release, x, 1, n, nullptr);
+    throw;
+  }
+  if (remembered(y, penalty_))
+    file_->add(store_file::value, x, 1, n, &y);
+  else
+    file_->add(store_file::release, x, 1, n, nullptr);
+  return y;
+}
+
+// Rows that another process is evaluating are looked at again once ours
+// are done, by when they usually are too.
+void eval_store::evaluate(const double *xs, size_t m, size_t n, double *ys,
+                          const opt_func_batch &func) {
+  std::vector<size_t> waiting(m);
+  for (size_t i = 0; i < m; i++)
+    waiting[i] = i;
+  while (!waiting.empty()) {
+    std::vector<size_t> rows, busy;
+    std::vector<double> claimed;
+    for (size_t i : waiting) {
+      switch (file_->lookup(xs + i * n, n, ys[i])) {
+      case store_file::found:
+        break;
+      case store_file::busy:
+        busy.push_back(i);
+        break;
+      case store_file::claimed:
+        rows.push_back(i);
+        claimed.insert(claimed.end(), xs + i * n, xs + (i + 1) * n);
+        break;
+      }
+    }
+    if (!rows.empty()) {
+      std::vector<double> values(rows.size(), NAN);
+      try {
+        func(claimed.data(), rows.size(), n, values.data());
+      } catch (...) {
+        file_->add(store_file::release, claimed.data(), rows.size(), n,
+                      nullptr);
+        throw;
+      }
+      std::vector<double> kept, kept_values, failed;
+      size_t failures = 0;
+      for (size_t k = 0; k < rows.size(); k++) {
+        ys[rows[k]] = values[k];
+        const double *x = claimed.data() + k * n;
+        if (remembered(values[k], penalty_)) {
+          kept.insert(kept.end(), x, x + n);
+          kept_values.push_back(values[k]);
+        } else {
+          failed.insert(failed.end(), x, x + n);
+          failures++;
+        }
+      }
+      if (!kept_values.empty())
+        file_->add(store_file::value, kept.data(), kept_values.size(), n,
+                   kept_values.data());
+      if (failures > 0)
+        file_->add(store_file::release, failed.data(), failures, n, nullptr);
+    } else if (!busy.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    waiting = busy;
+  }
+}
+
+unsigned eval_store::hits() const { return file_->hits; }
+
+unsigned eval_store::misses() const { return file_->misses; }
+
+// A kd-tree that grows by insertion, splitting on the variables in turn.
+// Points are kept scaled to [0, 1] in each variable, one after another in
+// points_, and node i is point i.
+class kd_tree {
+public:
+  kd_tree(const std::vector<std::pair<double, double>> &domains,
+          double radius);
+  bool find(const double *x, double &y, double *at) const;
+  void insert(const double *x, double y);
+  size_t dimensions() const { return lo_.size(); }
+  mutable std::atomic<unsigned> hits{0};
+
+private:
+  static constexpr size_t none = SIZE_MAX;
+  struct node {
+    size_t left = none, right = none;
+    size_t size = 1; // of the subtree
+  };
+  void scale(const double *x, double *out) const;
+  size_t size(size_t i) const { return i == none ? 0 : nodes_[i].size; }
+  size_t build(size_t *begin, size_t *end, size_t depth);
+  std::vector<double> lo_, width_;
+  double radius_;
+  std::vector<double> points_;
+  std::vector<double> originals_; // the points as given, for find()'s at
+  std::vector<double> values_;
+  std::vector<node> nodes_;
+  size_t root_ = none;
+  mutable std::shared_mutex mutex_;
+};
+
+kd_tree::kd_tree(const std::vector<std::pair<double, double>> &domains,
+                 double radius)
+    : radius_(radius) {
+  for (auto &d : domains) {
+    lo_.push_back(d.first);
+    width_.push_back(d.second > d.first ? d.second - d.first : 1.0);
+  }
+}
+
+void kd_tree::scale(const double *x, double *out) const {
+  for (size_t j = 0; j < lo_.size(); j++)
+    out[j] = (x[j] - lo_[j]) / width_[j];
+}
+
+// The value of the nearest point within the radius in every variable, and
+// the point itself if at is not null. at may be x.
+bool kd_tree::find(const double *x, double &y, double *at) const {
+  size_t n = lo_.size();
+  std::vector<double> q(n);
+  scale(x, q.data());
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  if (root_ == none)
+    return false;
+  size_t best = 0;
+  double best_distance = INFINITY;
+  std::vector<std::pair<size_t, size_t>> todo = {{root_, 0}}; // node, depth
+  while (!todo.empty()) {
+    auto [i, depth] = todo.back();
+    todo.pop_back();
+    const double *p = points_.data() + i * n;
+    double distance = 0.0;
+    bool within = true;
+    for (size_t j = 0; j < n && within; j++) {
+      double d = q[j] - p[j];
+      within = std::fabs(d) <= radius_;
+      distance += d * d;
+    }
+    if (within && distance < best_distance) {
+      best = i;
+      best_distance = distance;
+    }
+    // Points equal to p on the axis may be on either side.
+    size_t axis = depth % n;
+    if (nodes_[i].left != none && q[axis] - radius_ <= p[axis])
+      todo.push_back({nodes_[i].left, depth + 1});
+    if (nodes_[i].right != none && q[axis] + radius_ >= p[axis])
+      todo.push_back({nodes_[i].right, depth + 1});
+  }
+  if (best_distance == INFINITY)
+    return false;
+  y = values_[best];
+  if (at)
+    std::copy(originals_.begin() + best * n,
+              originals_.begin() + (best + 1) * n, at);
+  return true;
+}
+
+// Balances [begin, end) around the median on the axis for depth, and
+// returns the root.
+size_t kd_tree::build(size_t *begin, size_t *end, size_t depth) {
+  if (begin == end)
+    return none;
+  size_t n = lo_.size(), axis = depth % n;
+  size_t *middle = begin + (end - begin) / 2;
+  std::nth_element(begin, middle, end, [&](size_t a, size_t b) {
+    return points_[a * n + axis] < points_[b * n + axis];
+  });
+  node &m = nodes_[*middle];
+  m.left = build(begin, middle, depth + 1);
+  m.right = build(middle + 1, end, depth + 1);
+  m.size = end - begin;
+  return *middle;
+}
+
+// Points arrive in sweeps, which would make a plain kd-tree a chain, so
+// this is a scapegoat tree: an insert deeper than log base 1 / alpha of the
+// size rebuilds the subtree of the deepest ancestor with a child holding
+// more than alpha of it, which keeps find() logarithmic.
+void kd_tree::insert(const double *x, double y) {
+  const double alpha = 0.7;
+  size_t n = lo_.size();
+  std::vector<double> q(n);
+  scale(x, q.data());
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  size_t added = nodes_.size();
+  nodes_.push_back(node());
+  points_.insert(points_.end(), q.begin(), q.end());
+  originals_.insert(originals_.end(), x, x + n);
+  values_.push_back(y);
+  std::vector<size_t> path;
+  size_t *link = &root_;
+  while (*link != none) {
+    size_t i = *link, axis = path.size() % n;
+    path.push_back(i);
+    nodes_[i].size++;
+    link = q[axis] < points_[i * n + axis] ? &nodes_[i].left
+                                            : &nodes_[i].right;
+  }
+  *link = added;
+  if (path.size() <= std::log(nodes_.size()) / std::log(1.0 / alpha))
+    return;
+  size_t child = added;
+  for (size_t depth = path.size(); depth-- > 0; child = path[depth]) {
+    size_t i = path[depth];
+    if (size(child) <= alpha * nodes_[i].size)
+      continue;
+    std::vector<size_t> members, todo = {i};
+    while (!todo.empty()) {
+      size_t j = todo.back();
+      todo.pop_back();
+      members.push_back(j);
+      for (size_t c : {nodes_[j].left, nodes_[j].right})
+        if (c != none)
+          todo.push_back(c);
+    }
+    size_t top = build(members.data(), members.data() + members.size(), depth);
+    if (depth == 0)
+      root_ = top;
+    else if (nodes_[path[depth - 1]].left == i)
+      nodes_[path[depth - 1]].left = top;
+    else
+      nodes_[path[depth - 1]].right = top;
+    return;
+  }
+}
+
+reuse_index::reuse_index(
+    const std::vector<std::pair<double, double>> &domains, double radius)
+    : tree_(std::make_shared<kd_tree>(domains, radius)) {}
+
+bool reuse_index::find(const double *x, size_t n, double &y,
+                       double *at) const {
+  if (n != tree_->dimensions() || !tree_->find(x, y, at))
+    return false;
+  tree_->hits++;
+  return true;
+}
+
+bool reuse_index::evaluated(const double *x, size_t n, double &y) const {
+  std::vector<double> at(n);
+  double value;
+  if (n != tree_->dimensions() || !tree_->find(x, value, at.data()) ||
+      !std::equal(at.begin(), at.end(), x))
+    return false;
+  y = value;
+  return true;
+}
+
+// Failed evaluations aren't worth reusing.
+void reuse_index::insert(const double *x, size_t n, double y) {
+  if (n == tree_->dimensions() && !std::isnan(y))
+    tree_->insert(x, y);
+}
+
+unsigned reuse_index::hits() const { return tree_->hits; }
+
+// A ring of rows filled by one thread and emptied by the log's writer.
+// head is only written by the thread and tail only by the writer, so
+// neither needs a lock. Row i is in slot i & mask.
+struct log_ring {
+  log_ring(size_t rows, size_t n, unsigned thread)
+      : mask(rows - 1), thread(thread), times(new int64_t[rows]),
+        walls(new int64_t[rows]), values(new double[rows * (n + 1)]) {}
+  size_t mask;
+  unsigned thread;
+  std::unique_ptr<int64_t[]> times;
+  std::unique_ptr<int64_t[]> walls;
+  std::unique_ptr<double[]> values; // y, then x, for each row
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+};
+
+class log_writer {
+public:
+  log_writer(const std::string &path, size_t n);
+  ~log_writer();
+  void add(const double *x, double y, eval_log::clock::time_point start,
+           eval_log::clock::time_point end);
+
+  // The file starts with a header, and each block with the number of rows
+  // in it, followed by that many times, walls, threads, values and then
+  // each variable in turn, in the byte order of the machine.
+  struct header {
+    char magic[8];
+    uint32_t n;
+    uint32_t reserved;
+  };
+
+private:
+  log_ring &ring();
+  void loop();
+  bool drain();
+  static std::atomic<uint64_t> logs_;
+  std::string path_;
+  size_t n_;
+  size_t rows_;
+  int fd_;
+  uint64_t id_;
+  // The clocks when the log was opened, to turn steady times into times
+  // since the epoch.
+  eval_log::clock::time_point start_;
+  int64_t epoch_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::atomic<bool> failed_{false};
+  std::deque<std::unique_ptr<log_ring>> rings_;
+  std::unordered_map<std::thread::id, log_ring *> by_thread_;
+  std::thread thread_;
+};
+
+std::atomic<uint64_t> log_writer::logs_{0};
+
+static bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// The bytes of each row of a block, after its count.
+static uint64_t log_row_size(uint64_t n) {
+  return 2 * sizeof(int64_t) + sizeof(uint32_t) + (n + 1) * sizeof(double);
+}
+
+// An existing log is appended to, if it is for the same number of
+// variables, so a resumed run carries on the log of the interrupted one.
+// A run killed part way through writing a block leaves the rest of it
+// missing, and the rows appended after it would be read as part of it, so
+// the log is first cut back to its last whole block.
+log_writer::log_writer(const std::string &path, size_t n)
+    : path_(path), n_(n), id_(++logs_), start_(eval_log::clock::now()) {
+  // About a megabyte per thread, and a power of two rows.
+  rows_ = 1024;
+  while (rows_ * (n + 3) * sizeof(double) < (1 << 20))
+    rows_ *= 2;
+  epoch_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+               .count();
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("can't write evaluation log " + path);
+  struct stat st;
+  header h = {};
+  bool ok = fstat(fd_, &st) == 0;
+  if (ok && st.st_size == 0) {
+    std::memcpy(h.magic, "FITLOG1", sizeof h.magic);
+    h.n = n;
+    ok = write_all(fd_, (const char *)&h, sizeof h);
+  } else if (ok) {
+    ok = pread(fd_, &h, sizeof h, 0) == sizeof h &&
+         std::memcmp(h.magic, "FITLOG1", sizeof h.magic) == 0 && h.n == n;
+  }
+  if (!ok) {
+    close(fd_);
+    throw std::runtime_error(path + " is not an evaluation log for " +
+                             std::to_string(n) + " variables");
+  }
+  uint64_t size = st.st_size, end = sizeof h, rows;
+  while (end + sizeof rows <= size &&
+         pread(fd_, &rows, sizeof rows, end) == sizeof rows &&
+         rows <= (size - end - sizeof rows) / log_row_size(n))
+    end += sizeof rows + rows * log_row_size(n);
+  if (end < size && ftruncate(fd_, end) != 0) {
+    close(fd_);
+    throw std::runtime_error("can't write evaluation log " + path);
+  }
+  thread_ = std::thread([this] { loop(); });
+}
+
+log_writer::~log_writer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  thread_.join();
+  close(fd_);
+}
+
+// The calling thread's ring, remembered in a thread local for the log it
+// was last asked for.
+log_ring &log_writer::ring() {
+  thread_local uint64_t owner = 0;
+  thread_local log_ring *ring = nullptr;
+  if (owner == id_)
+    return *ring;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &r = by_thread_[std::this_thread::get_id()];
+  if (!r) {
+    rings_.push_back(std::make_unique<log_ring>(rows_, n_, rings_.size()));
+    r = rings_.back().get();
+  }
+  owner = id_;
+  ring = r;
+  return *ring;
+}
+
+void log_writer::add(const double *x, double y,
+                     eval_log::clock::time_point start,
+                     eval_log::clock::time_point end) {
+  if (failed_.load(std::memory_order_relaxed))
+    throw std::runtime_error("can't write evaluation log " + path_);
+  log_ring &r = ring();
+  size_t head = r.head.load(std::memory_order_relaxed);
+  size_t used = head - r.tail.load(std::memory_order_acquire);
+  // A full ring waits for the writer rather than losing rows.
+  while (used > r.mask) {
+    wake_.notify_one();
+    std::this_thread::yield();
+    used = head - r.tail.load(std::memory_order_acquire);
+  }
+  size_t slot = head & r.mask;
+  r.times[slot] = epoch_ + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               start - start_)
+                               .count();
+  r.walls[slot] =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  double *values = &r.values[slot * (n_ + 1)];
+  values[0] = y;
+  std::copy(x, x + n_, values + 1);
+  r.head.store(head + 1, std::memory_order_release);
+  if (used + 1 == (r.mask + 1) / 2)
+    wake_.notify_one();
+}
+
+void log_writer::loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    wake_.wait_for(lock, std::chrono::milliseconds(10));
+    lock.unlock();
+    if (!drain())
+      failed_ = true;
+    lock.lock();
+  }
+  lock.unlock();
+  if (!drain())
+    failed_ = true;
+}
+
+// Writes the rows in the rings as one block.
+bool log_writer::drain() {
+  std::vector<log_ring *> rings;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &r : rings_)
+      rings.push_back(r.get());
+  }
+  std::vector<size_t> heads;
+  uint64_t rows = 0;
+  for (auto r : rings) {
+    heads.push_back(r->head.load(std::memory_order_acquire));
+    rows += heads.back() - r->tail.load(std::memory_order_relaxed);
+  }
+  if (rows == 0)
+    return true;
+  std::vector<char> block(sizeof rows + rows * log_row_size(n_));
+  std::memcpy(block.data(), &rows, sizeof rows);
+  char *times = block.data() + sizeof rows;
+  char *walls = times + rows * sizeof(int64_t);
+  char *threads = walls + rows * sizeof(int64_t);
+  char *values = threads + rows * sizeof(uint32_t);
+  size_t row = 0;
+  for (size_t k = 0; k < rings.size(); k++) {
+    log_ring &r = *rings[k];
+    uint32_t thread = r.thread;
+    for (size_t i = r.tail.load(std::memory_order_relaxed); i != heads[k];
+         i++, row++) {
+      size_t slot = i & r.mask;
+      std::memcpy(times + row * sizeof(int64_t), &r.times[slot],
+                  sizeof(int64_t));
+      std::memcpy(walls + row * sizeof(int64_t), &r.walls[slot],
+                  sizeof(int64_t));
+      std::memcpy(threads + row * sizeof(uint32_t), &thread, sizeof thread);
+      for (size_t j = 0; j <= n_; j++)
+        std::memcpy(values + (j * rows + row) * sizeof(double),
+                    &r.values[slot * (n_ + 1) + j], sizeof(double));
+    }
+    r.tail.store(heads[k], std::memory_order_release);
+  }
+  return write_all(fd_, block.data(), block.size());
+}
+
+eval_log::eval_log(const std::string &path, size_t n)
+    : writer_(std::make_shared<log_writer>(path, n)) {}
+
+void eval_log::add(const double *x, double y, clock::time_point start,
+                   clock::time_point end) {
+  writer_->add(x, y, start, end);
+}
+
+std::vector<log_record> read_log(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  log_writer::header h;
+  if (!in.read((char *)&h, sizeof h) ||
+      std::memcmp(h.magic, "FITLOG1", sizeof h.magic) != 0)
+    throw std::runtime_error(path + " is not an evaluation log");
+  in.seekg(0, std::ios::end);
+  uint64_t size = in.tellg();
+  in.seekg(sizeof h);
+  std::vector<log_record> records;
+  uint64_t rows;
+  while (in.read((char *)&rows, sizeof rows)) {
+    // A count that the rest of the file can't hold is a block still being
+    // written, or a broken one, and must not size the vectors.
+    if (rows > (size - (uint64_t)in.tellg()) / log_row_size(h.n))
+      break;
+    std::vector<int64_t> times(rows), walls(rows);
+    std::vector<uint32_t> threads(rows);
+    std::vector<double> values(rows * (h.n + 1));
+    if (!in.read((char *)times.data(), rows * sizeof(int64_t)) ||
+        !in.read((char *)walls.data(), rows * sizeof(int64_t)) ||
+        !in.read((char *)threads.data(), rows * sizeof(uint32_t)) ||
+        !in.read((char *)values.data(), values.size() * sizeof(double)))
+      break;
+    for (size_t i = 0; i < rows; i++) {
+      log_record r;
+      r.time = times[i];
+      r.wall = walls[i];
+      r.thread = threads[i];
+      r.y = values[i];
+      for (size_t j = 1; j <= h.n; j++)
+        r.x.push_back(values[j * rows + i]);
+      records.push_back(r);
+    }
+  }
+  return records;
+}
+
+static volatile std::sig_atomic_t interrupted_by = 0;
+
+static void on_signal(int signal) { interrupted_by = signal; }
+
+void catch_signals() {
+  struct sigaction action = {};
+  action.sa_handler = on_signal;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+}
+
+int interrupted() { return interrupted_by; }
+
+void interrupt(int signal) { interrupted_by = signal; }
+
+// One value per line after a name, with doubles in hexadecimal so that
+// they are read back exactly.
+void checkpoint::save(const std::string &path) const {
+  std::string temporary = path + ".tmp";
+  FILE *f = fopen(temporary.c_str(), "w");
+  if (f == NULL)
+    throw std::runtime_error("can't write checkpoint " + temporary);
+  fprintf(f, "fit checkpoint 1\n");
+  fprintf(f, "method %s\n", method.c_str());
+  fprintf(f, "function %s\n", function.c_str());
+  fprintf(f, "variables %u\n", variables);
+  fprintf(f, "divisions");
+  for (unsigned d : divisions)
+    fprintf(f, " %u", d);
+  fprintf(f, "\npasses %u\n", passes);
+  fprintf(f, "iterations %u\n", iterations);
+  fprintf(f, "seed %llu\n", (unsigned long long)seed);
+  fprintf(f, "invocation %u\n", invocation);
+  fprintf(f, "position %u\n", position);
+  fprintf(f, "calls %u\n", calls);
+  fprintf(f, "lowest %a\n", lowest);
+  fprintf(f, "best");
+  for (double v : best)
+    fprintf(f, " %a", v);
+  fprintf(f, "\ndomains");
+  for (auto &d : domains)
+    fprintf(f, " %a %a", d.first, d.second);
+  fprintf(f, "\n");
+  bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    throw std::runtime_error("can't write checkpoint " + path);
+  }
+  // The rename is only durable once the directory is.
+  size_t slash = path.rfind('/');
+  std::string directory = slash == std::string::npos ? "."
+                          : slash == 0               ? "/"
+                                                     : path.substr(0, slash);
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  ok = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!ok)
+    throw std::runtime_error("can't write checkpoint " + path);
+}
+
+checkpoint checkpoint::load(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line) || line != "fit checkpoint 1")
+    throw std::runtime_error(path + " is not a checkpoint");
+  checkpoint c;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string name, value;
+    fields >> name;
+    std::vector<double> values;
+    while (fields >> value)
+      values.push_back(std::strtod(value.c_str(), nullptr));
+    if (name == "method") {
+      std::istringstream(line.substr(name.size())) >> c.method;
+    } else if (name == "function") {
+      c.function = line.size() > name.size() ? line.substr(name.size() + 1)
+                                             : "";
+    } else if (name == "variables" && values.size() == 1) {
+      c.variables = values[0];
+    } else if (name == "divisions") {
+      c.divisions.assign(values.begin(), values.end());
+    } else if (name == "passes" && values.size() == 1) {
+      c.passes = values[0];
+    } else if (name == "iterations" && values.size() == 1) {
+      c.iterations = values[0];
+    } else if (name == "seed") {
+      std::istringstream(line.substr(name.size())) >> c.seed;
+    } else if (name == "invocation" && values.size() == 1) {
+      c.invocation = values[0];
+    } else if (name == "position" && values.size() == 1) {
+      c.position = values[0];
+    } else if (name == "calls" && values.size() == 1) {
+      c.calls = values[0];
+    } else if (name == "lowest" && values.size() == 1) {
+      c.lowest = values[0];
+    } else if (name == "best") {
+      c.best = values;
+    } else if (name == "domains") {
+      for (size_t i = 0; i + 1 < values.size(); i += 2)
+        c.domains.push_back({values[i], values[i + 1]});
+    }
+  }
+  return c;
+}
+
+// Test functions. The pointer versions are in simd.cpp.
 double sphere(const std::vector<double> &v) {
-  double total = 0.0;
-  for (auto x : v)
-    total += x * x;
-  return total;
+  return sphere_ptr(v.data(), v.size());
+}
+
+std::vector<double> sphere_dx(const std::vector<double> &v) {
+  std::vector<double> result(v.size());
+  sphere_dx_ptr(v.data(), v.size(), result.data());
+  return result;
+}
+
+double rastrigin(const std::vector<double> &v) {
+  return rastrigin_ptr(v.data(), v.size());
+}
+
+double flipflop(const std::vector<double> &v) {
+  return flipflop_ptr(v.data(), v.size());
+}
+
+opt_func_batch batch_adapter(const opt_func &func) {
+  return [func](const double *xs, size_t m, size_t n, double *ys) {
+    for (size_t i = 0; i < m; i++)
+      ys[i] = func(std::vector<double>(xs + i * n, xs + (i + 1) * n));
+  };
+}
+
+opt_func point_adapter(const opt_func_batch &func) {
+  return [func](const std::vector<double> &x) {
+    double y = NAN;
+    func(x.data(), 1, x.size(), &y);
+    return y;
+  };
+}
+
+opt_func_ptr pointer_adapter(const opt_func &func) {
+  return [func](const double *x, size_t n) {
+    return func(std::vector<double>(x, x + n));
+  };
+}
+
+opt_func_dx_ptr pointer_adapter_dx(const opt_func_dx &dx) {
+  return [dx](const double *x, size_t n, double *result) {
+    auto v = dx(std::vector<double>(x, x + n));
+    std::copy(v.begin(), v.begin() + std::min(v.size(), n), result);
+  };
+}
+
+opt_func vector_adapter(const opt_func_ptr &func) {
+  return [func](const std::vector<double> &x) {
+    return func(x.data(), x.size());
+  };
+}
+
+opt_func_dx vector_adapter_dx(const opt_func_dx_ptr &dx) {
+  return [dx](const std::vector<double> &x) {
+    std::vector<double> result(x.size());
+    dx(x.data(), x.size(), result.data());
+    return result;
+  };
+}
+
+// Frames are a 32 bit little-endian count followed by that many
+// little-endian IEEE 754 doubles. Bytes are assembled by hand so this works
+// whatever the byte order of the host.
+void write_frame(std::ostream &os, const std::vector<double> &v) {
+  std::string frame(4 + 8 * v.size(), '\0');
+  uint32_t n = v.size();
+  for (size_t b = 0; b < 4; b++)
+    frame[b] = (char)(n >> (8 * b));
+  for (size_t i = 0; i < v.size(); i++) {
+    uint64_t u;
+    std::memcpy(&u, &v[i], sizeof u);
+    for (size_t b = 0; b < 8; b++)
+      frame[4 + 8 * i + b] = (char)(u >> (8 * b));
+  }
+  os.write(frame.data(), frame.size());
+  os.flush();
+}
+
+bool read_frame(std::istream &is, std::vector<double> &v, size_t max) {
+  unsigned char header[4];
+  if (!is.read((char *)header, sizeof header))
+    return false;
+  uint32_t n = 0;
+  for (size_t b = 0; b < 4; b++)
+    n |= (uint32_t)header[b] << (8 * b);
+  if (n > max)
+    return false;
+  std::vector<unsigned char> body(8 * (size_t)n);
+  if (n > 0 && !is.read((char *)body.data(), body.size()))
+    return false;
+  v.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t u = 0;
+    for (size_t b = 0; b < 8; b++)
+      u |= (uint64_t)body[8 * i + b] << (8 * b);
+    std::memcpy(&v[i], &u, sizeof u);
+  }
+  return true;
+}
+
+// Vectors passed as text are printed with enough digits to be read back
+// exactly, so that nearby grid points never collapse into the same string.
+static std::string text_args(const std::vector<double> &x_i) {
+  std::stringstream args;
+  args << std::setprecision(std::numeric_limits<double>::max_digits10);
+  for (auto x : x_i)
+    args << x << " ";
+  return args.str();
+}
+
+// Splits a command line into words once, so that it needn't be parsed on
+// every call. Quotes and backslashes work as in the shell, so a path
+// containing spaces can be given as "/path with spaces/model".
+static std::vector<std::string> split_command(const std::string &command) {
+  std::vector<std::string> words;
+  std::string word;
+  bool in_word = false;
+  char quote = 0;
+  for (size_t i = 0; i < command.size(); i++) {
+    char c = command[i];
+    if (quote) {
+      if (c == quote)
+        quote = 0;
+      else if (c == '\\' && quote == '"' && i + 1 < command.size())
+        word += command[++i];
+      else
+        word += c;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+      in_word = true;
+    } else if (c == '\\' && i + 1 < command.size()) {
+      word += command[++i];
+      in_word = true;
+    } else if (std::isspace((unsigned char)c)) {
+      if (in_word)
+        words.push_back(word);
+      word.clear();
+      in_word = false;
+    } else {
+      word += c;
+      in_word = true;
+    }
+  }
+  if (quote)
+    throw std::invalid_argument("unterminated quote in command: " + command);
+  if (in_word)
+    words.push_back(word);
+  return words;
+}
+
+// Looks the program up in PATH once, rather than on every spawn.
+static std::string find_program(const std::string &name) {
+  if (name.find('/') != std::string::npos)
+    return name;
+  const char *path = getenv("PATH");
+  std::stringstream dirs(path ? path : "/usr/bin:/bin");
+  std::string dir;
+  while (std::getline(dirs, dir, ':')) {
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+    if (access(candidate.c_str(), X_OK) == 0)
+      return candidate;
+  }
+  return name;
+}
+
+// Thrown when an external evaluation runs past its timeout and has been
+// killed. The functors catch it and score the evaluation as the penalty.
+struct timed_out : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Blocks SIGPIPE in the calling thread while it lives, so that writing to a
+// model that has exited fails with EPIPE instead of killing fit. A SIGPIPE
+// raised meanwhile is taken off the thread before the old mask comes back.
+// The disposition of the signal is left alone, as it belongs to whatever
+// program fit is part of.
+class sigpipe_blocker {
+public:
+  sigpipe_blocker() {
+    sigemptyset(&set_);
+    sigaddset(&set_, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set_, &old_);
+    sigset_t pending;
+    sigpending(&pending);
+    was_pending_ = sigismember(&pending, SIGPIPE);
+  }
+  ~sigpipe_blocker() {
+    sigset_t pending;
+    sigpending(&pending);
+    if (!was_pending_ && sigismember(&pending, SIGPIPE)) {
+      timespec zero{0, 0};
+      while (sigtimedwait(&set_, nullptr, &zero) < 0 && errno == EINTR)
+        ;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_, nullptr);
+  }
+  sigpipe_blocker(const sigpipe_blocker &) = delete;
+  sigpipe_blocker &operator=(const sigpipe_blocker &) = delete;
+
+private:
+  sigset_t set_;
+  sigset_t old_;
+  bool was_pending_;
+};
+
+// Reads the values in a text reply. Anything that isn't a number means the
+// model has gone wrong, and is an error rather than a value.
+static std::vector<double> parse_values(const std::string &text,
+                                        const std::string &command) {
+  std::vector<double> result;
+  std::stringstream is(text);
+  double d;
+  while (is >> d)
+    result.push_back(d);
+  if (!is.eof()) {
+    std::string s = "unreadable reply from program: " + command;
+    throw std::runtime_error(s.c_str());
+  }
+  return result;
+}
+
+// Milliseconds left until deadline, for poll() and epoll_wait(). Never
+// negative and rounded up, so that a wait doesn't end just short of it.
+static int millis_until(std::chrono::steady_clock::time_point deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                  deadline - std::chrono::steady_clock::now())
+                  .count();
+  return left > 0 ? static_cast<int>((left + 999) / 1000) : 0;
+}
+
+// A program started by launcher::start(). in is only used when vectors are
+// sent on stdin, in which case input is what to write to it. A reply frame
+// may hold no more than limit values.
+struct launched {
+  pid_t pid = -1;
+  int in = -1;
+  int out = -1;
+  std::string input;
+  size_t limit = 1;
+  std::chrono::steady_clock::time_point started;
+};
+
+// Starts a fresh copy of an external program for every call without going
+// through a shell. The command is split and looked up once. posix_spawn uses
+// vfork semantics, so the cost of starting the program doesn't grow with the
+// size of fit. Time spent in posix_spawn, and in the whole call, is
+// accumulated for spawn_stats.
+//
+// In batch mode every call may carry several vectors. They are written to
+// the program's stdin, one per line or one frame each, and it replies with
+// one value per vector. Without batch mode a text vector goes on the command
+// line.
+//
+// call() does a whole evaluation, and throws if the program exits with a
+// non-zero status or is killed by a signal. start() and finish() are the two
+// halves of it for callers that do their own waiting, like supervisor. If
+// timeout is not 0, call() kills a program that runs longer than that many
+// seconds and throws timed_out.
+class launcher {
+public:
+  launcher(const std::string &command, bool binary, bool batch = false,
+           const eval_limits &limits = eval_limits());
+  std::vector<double> call(const std::vector<std::vector<double>> &xs);
+  launched start(const std::vector<std::vector<double>> &xs);
+  std::vector<double> finish(const launched &child, const std::string &reply);
+  spawn_stats stats() const;
+  const std::string &command() const { return command_; }
+  double timeout() const { return timeout_; }
+
+private:
+  std::string command_;
+  bool binary_;
+  bool batch_;
+  double timeout_;
+  bool group_;
+  std::vector<std::string> words_;
+  std::atomic<unsigned> spawns_{0};
+  std::atomic<unsigned> timeouts_{0};
+  std::atomic<uint64_t> spawn_ns_{0};
+  std::atomic<uint64_t> call_ns_{0};
+};
+
+launcher::launcher(const std::string &command, bool binary, bool batch,
+                   const eval_limits &limits)
+    : command_(command), binary_(binary), batch_(batch),
+      timeout_(limits.timeout),
+      group_(limits.timeout > 0.0 || limits.speculate > 0.0),
+      words_(split_command(command)) {
+  if (words_.empty())
+    throw std::invalid_argument("command for external function is empty");
+  words_[0] = find_program(words_[0]);
+}
+
+static void close_pipe(int fds[2]) {
+  for (int i = 0; i < 2; i++)
+    if (fds[i] >= 0)
+      close(fds[i]);
+}
+
+launched launcher::start(const std::vector<std::vector<double>> &xs) {
+  launched child;
+  child.started = std::chrono::steady_clock::now();
+  // Enough for a value per vector, or a gradient for one.
+  for (auto &x_i : xs)
+    child.limit = std::max(child.limit, x_i.size());
+  child.limit = std::max(child.limit, xs.size());
+
+  std::vector<std::string> args = words_;
+  bool use_stdin = binary_ || batch_;
+  if (binary_) {
+    std::stringstream frames;
+    for (auto &x_i : xs)
+      write_frame(frames, x_i);
+    child.input = frames.str();
+  } else if (batch_) {
+    for (auto &x_i : xs)
+      child.input += text_args(x_i) + "\n";
+  } else if (xs.size() > 0) {
+    std::stringstream ss;
+    ss << std::setprecision(std::numeric_limits<double>::max_digits10);
+    for (auto x : xs[0]) {
+      ss.str("");
+      ss << x;
+      args.push_back(ss.str());
+    }
+  }
+  std::vector<char *> argv;
+  for (auto &arg : args)
+    argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  // Both pipes are close-on-exec so that programs started by other threads
+  // don't hold them open; the child gets its ends through dup2.
+  int in[2] = {-1, -1}, out[2] = {-1, -1};
+  if ((use_stdin && pipe2(in, O_CLOEXEC) != 0) ||
+      pipe2(out, O_CLOEXEC) != 0) {
+    close_pipe(in);
+    std::string s = "can't create pipe for program: " + command_;
+    throw std::runtime_error(s.c_str());
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (use_stdin)
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  // A program that may be killed gets a process group of its own, so that
+  // anything it starts is killed along with it.
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  if (group_) {
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+  }
+
+  auto spawn_start = std::chrono::steady_clock::now();
+  int err = posix_spawn(&child.pid, argv[0], &actions, &attributes,
+                        argv.data(), environ);
+  auto spawn_end = std::chrono::steady_clock::now();
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  if (use_stdin) {
+    close(in[0]);
+    in[0] = -1;
+  }
+  close(out[1]);
+  out[1] = -1;
+  if (err != 0) {
+    close_pipe(in);
+    close_pipe(out);
+    std::string s = "can't call program: " + command_;
+    throw std::runtime_error(s.c_str());
+  }
+  spawns_++;
+  spawn_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   spawn_end - spawn_start)
+                   .count();
+  child.in = in[1];
+  child.out = out[0];
+  return child;
+}
+
+std::vector<double> launcher::finish(const launched &child,
+                                     const std::string &reply) {
+  std::vector<double> result;
+  std::stringstream is(reply);
+  if (binary_) {
+    // A batch may be answered with one frame per vector or with a single
+    // frame holding all the values.
+    std::vector<double> frame;
+    bool any = false;
+    while (read_frame(is, frame, child.limit)) {
+      result.insert(result.end(), frame.begin(), frame.end());
+      any = true;
+    }
+    if (!any) {
+      std::string s = "no reply from program: " + command_;
+      throw std::runtime_error(s.c_str());
+    }
+  } else {
+    result = parse_values(reply, command_);
+  }
+  call_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - child.started)
+                  .count();
+  return result;
+}
+
+std::vector<double>
+launcher::call(const std::vector<std::vector<double>> &xs) {
+  launched child = start(xs);
+  auto deadline =
+      child.started + std::chrono::microseconds(
+                          static_cast<int64_t>(timeout_ * 1e6));
+  // Without a timeout the pipes block as usual. With one, every read and
+  // write is preceded by a poll() that gives up at the deadline.
+  auto ready = [&](int fd, short events) {
+    if (timeout_ <= 0.0)
+      return true;
+    pollfd p{fd, events, 0};
+    int n;
+    while ((n = poll(&p, 1, millis_until(deadline))) < 0 && errno == EINTR)
+      ;
+    return n > 0;
+  };
+  bool expired = false;
+
+  if (child.in >= 0) {
+    sigpipe_blocker blocker;
+    const std::string &bytes = child.input;
+    if (timeout_ > 0.0)
+      fcntl(child.in, F_SETFL, O_NONBLOCK);
+    for (size_t done = 0; done < bytes.size();) {
+      if (!ready(child.in, POLLOUT)) {
+        expired = true;
+        break;
+      }
+      ssize_t n = write(child.in, bytes.data() + done, bytes.size() - done);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(child.in);
+  }
+
+  std::string reply;
+  char buf[4096];
+  while (!expired) {
+    if (!ready(child.out, POLLIN)) {
+      expired = true;
+      break;
+    }
+    ssize_t n = read(child.out, buf, sizeof buf);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    reply.append(buf, n);
+  }
+  close(child.out);
+  if (expired) {
+    kill(-child.pid, SIGKILL);
+    int status;
+    while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR)
+      ;
+    timeouts_++;
+    std::string s = "program timed out: " + command_;
+    throw timed_out(s.c_str());
+  }
+  int status;
+  while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  // What a program that failed or was killed left on stdout isn't a reply.
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::string s = "program failed: " + command_;
+    throw std::runtime_error(s.c_str());
+  }
+  return finish(child, reply);
+}
+
+spawn_stats launcher::stats() const {
+  spawn_stats s;
+  s.spawns = spawns_;
+  s.spawn_seconds = spawn_ns_ * 1e-9;
+  s.call_seconds = call_ns_ * 1e-9;
+  s.timeouts = timeouts_;
+  return s;
+}
+
+// If an external program is being optimized this is the
+// function that must be called.
+external::external(std::string &command, const std::string &protocol,
+                   unsigned batch, const eval_limits &limits)
+    : launcher_(std::make_shared<launcher>(command, protocol == "binary",
+                                           batch > 0, limits)),
+      batch_(std::max(batch, 1u)), penalty_(limits.penalty){};
+
+double external::operator()(const std::vector<double> &x_i) {
+  try {
+    auto result = launcher_->call({x_i});
+    return result.size() > 0 ? result[0] : NAN;
+  } catch (timed_out &) {
+    return penalty_;
+  }
+};
+
+// Sends the vectors batch at a time, so one program start is shared by
+// batch evaluations.
+std::vector<double>
+external::evaluate(const std::vector<std::vector<double>> &xs) {
+  std::vector<double> results;
+  for (size_t i = 0; i < xs.size(); i += batch_) {
+    std::vector<std::vector<double>> chunk(
+        xs.begin() + i, xs.begin() + std::min(xs.size(), i + batch_));
+    std::vector<double> values;
+    try {
+      values = launcher_->call(chunk);
+    } catch (timed_out &) {
+      values.assign(chunk.size(), penalty_);
+    }
+    if (values.size() < chunk.size()) {
+      std::string s = "program returned fewer values than it was sent: " +
+                      launcher_->command();
+      throw std::runtime_error(s.c_str());
+    }
+    results.insert(results.end(), values.begin(),
+                   values.begin() + chunk.size());
+  }
+  return results;
+}
+
+spawn_stats external::stats() const { return launcher_->stats(); }
+
+external_dx::external_dx(std::string &command, const std::string &protocol,
+                         const eval_limits &limits)
+    : launcher_(std::make_shared<launcher>(command, protocol == "binary",
+                                           false, limits)),
+      penalty_(limits.penalty){};
+
+// If an external program is being optimized  and it also has an external
+// gradient function this is the function that must be called.
+std::vector<double> external_dx::operator()(const std::vector<double> &x_i) {
+  try {
+    return launcher_->call({x_i});
+  } catch (timed_out &) {
+    return std::vector<double>(x_i.size(), penalty_);
+  }
+};
+
+spawn_stats external_dx::stats() const { return launcher_->stats(); }
+
+// Keeps up to in_flight external programs running at once from a single
+// event loop thread, rather than one blocked thread per program. Jobs are
+// queued by submit() and started as earlier ones finish; each program's
+// stdout (and stdin, for the binary protocol) is watched with epoll and the
+// reply is handed back through a future as soon as the program closes its
+// stdout. Programs are reaped after that, without holding up the reply.
+//
+// With a timeout, a program that overruns is killed and its future gets a
+// timed_out exception. With speculate, a program that has run speculate
+// times longer than the median of the recent calls gets a twin started on a
+// free slot, and the first of the two to reply wins while the other is
+// killed. A free slot is one that no queued job is waiting for, so
+// speculation only uses capacity that would otherwise sit idle.
+class supervisor {
+public:
+  supervisor(const std::string &command, bool binary, unsigned in_flight,
+             bool batch = false, const eval_limits &limits = eval_limits());
+  ~supervisor();
+  std::future<std::vector<double>>
+  submit(const std::vector<std::vector<double>> &xs);
+  spawn_stats stats() const;
+  const std::string &command() const { return launcher_.command(); }
+
+private:
+  // A submitted set of vectors, possibly being run by two programs at once.
+  struct job {
+    std::vector<std::vector<double>> xs;
+    std::promise<std::vector<double>> reply;
+    unsigned copies = 0;
+    bool done = false;
+    bool speculated = false;
+  };
+  // A program, from its launch until it is reaped.
+  struct running {
+    launched child;
+    std::shared_ptr<job> task;
+    std::string output;
+    size_t written = 0;
+    bool stopped = false; // killed, so whatever it left isn't a reply
+    bool expired = false; // killed for running past the timeout
+  };
+  void loop();
+  void start_jobs();
+  void launch(const std::shared_ptr<job> &j);
+  void write_input(running &r);
+  void read_output(running &r);
+  void close_pipes(running &r);
+  void stop(running &r);
+  void finished(running &r, int status);
+  void check_running();
+  double straggler_seconds() const;
+  int next_check() const;
+  void reap();
+  void watch(int fd, uint32_t events);
+  launcher launcher_;
+  unsigned in_flight_;
+  double speculate_;
+  int epoll_ = -1;
+  int wake_ = -1;
+  std::mutex mutex_;
+  std::deque<std::shared_ptr<job>> queue_;
+  bool stopping_ = false;
+  std::unordered_map<int, std::shared_ptr<running>> by_fd_;
+  std::vector<std::shared_ptr<running>> active_;
+  std::deque<double> latencies_;
+  unsigned children_ = 0;
+  std::atomic<unsigned> timeouts_{0};
+  std::atomic<unsigned> speculations_{0};
+  std::thread thread_;
+};
+
+supervisor::supervisor(const std::string &command, bool binary,
+                       unsigned in_flight, bool batch,
+                       const eval_limits &limits)
+    : launcher_(command, binary, batch, limits),
+      in_flight_(std::max(in_flight, 1u)), speculate_(limits.speculate) {
+  epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (epoll_ < 0 || wake_ < 0) {
+    if (epoll_ >= 0)
+      close(epoll_);
+    if (wake_ >= 0)
+      close(wake_);
+    throw std::runtime_error("can't set up external program supervisor");
+  }
+  watch(wake_, EPOLLIN);
+  thread_ = std::thread([this] { loop(); });
+}
+
+supervisor::~supervisor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  eventfd_write(wake_, 1);
+  thread_.join();
+  close(epoll_);
+  close(wake_);
+}
+
+std::future<std::vector<double>>
+supervisor::submit(const std::vector<std::vector<double>> &xs) {
+  auto j = std::make_shared<job>();
+  j->xs = xs;
+  auto reply = j->reply.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(j);
+  }
+  eventfd_write(wake_, 1);
+  return reply;
+}
+
+spawn_stats supervisor::stats() const {
+  spawn_stats s = launcher_.stats();
+  s.timeouts += timeouts_;
+  s.speculations = speculations_;
+  return s;
+}
+
+void supervisor::watch(int fd, uint32_t events) {
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void supervisor::start_jobs() {
+  for (;;) {
+    std::shared_ptr<job> j;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty() || children_ >= in_flight_)
+        return;
+      j = queue_.front();
+      queue_.pop_front();
+    }
+    launch(j);
+  }
+}
+
+// Starts a program for j, which may already have one running.
+void supervisor::launch(const std::shared_ptr<job> &j) {
+  auto r = std::make_shared<running>();
+  r->task = j;
+  try {
+    r->child = launcher_.start(j->xs);
+  } catch (...) {
+    if (j->copies == 0 && !j->done) {
+      j->done = true;
+      j->reply.set_exception(std::current_exception());
+    }
+    return;
+  }
+  j->copies++;
+  children_++;
+  active_.push_back(r);
+  fcntl(r->child.out, F_SETFL, O_NONBLOCK);
+  by_fd_[r->child.out] = r;
+  watch(r->child.out, EPOLLIN);
+  if (r->child.in >= 0) {
+    fcntl(r->child.in, F_SETFL, O_NONBLOCK);
+    by_fd_[r->child.in] = r;
+    write_input(*r);
+  }
+}
+
+void supervisor::write_input(running &r) {
+  const std::string &bytes = r.child.input;
+  while (r.written < bytes.size()) {
+    ssize_t n =
+        write(r.child.in, bytes.data() + r.written, bytes.size() - r.written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      // Carry on when there is room in the pipe. If we are already
+      // watching for that, adding it again fails harmlessly.
+      watch(r.child.in, EPOLLOUT);
+      return;
+    }
+    if (n <= 0)
+      break;
+    r.written += n;
+  }
+  // All written, or the program stopped reading: either way we're done.
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, r.child.in, nullptr);
+  by_fd_.erase(r.child.in);
+  close(r.child.in);
+  r.child.in = -1;
+}
+
+// Closes the pipes to a program that is finished with, for whatever reason.
+// It stays in active_ until reap() collects it.
+void supervisor::close_pipes(running &r) {
+  for (int *fd : {&r.child.out, &r.child.in}) {
+    if (*fd < 0)
+      continue;
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, *fd, nullptr);
+    by_fd_.erase(*fd);
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+// Kills a program, and anything it started, that timed out or lost the race
+// with its twin.
+void supervisor::stop(running &r) {
+  kill(-r.child.pid, SIGKILL);
+  r.stopped = true;
+  close_pipes(r);
+}
+
+void supervisor::read_output(running &r) {
+  char buf[4096];
+  for (;;) {
+    ssize_t n = read(r.child.out, buf, sizeof buf);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      return;
+    if (n <= 0)
+      break;
+    r.output.append(buf, n);
+  }
+  // End of file. The reply is only taken once reap() has seen the program
+  // exit, and exit cleanly.
+  close_pipes(r);
+}
+
+// Takes the reply of a program that has exited with status, as
+// launcher::call does: what one that failed or was killed left on stdout
+// isn't a reply.
+void supervisor::finished(running &r, int status) {
+  auto j = r.task;
+  if (j->done)
+    return;
+  if (r.stopped) {
+    // A timeout only counts if there is no twin left to answer.
+    if (r.expired && j->copies == 0) {
+      j->done = true;
+      std::string s = "program timed out: " + launcher_.command();
+      j->reply.set_exception(std::make_exception_ptr(timed_out(s.c_str())));
+    }
+    return;
+  }
+  try {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::string s = "program failed: " + launcher_.command();
+      throw std::runtime_error(s.c_str());
+    }
+    auto values = launcher_.finish(r.child, r.output);
+    j->done = true;
+    j->reply.set_value(values);
+  } catch (...) {
+    // A failed copy only counts if there is no twin left to answer.
+    if (j->copies == 0) {
+      j->done = true;
+      j->reply.set_exception(std::current_exception());
+    }
+    return;
+  }
+  std::chrono::duration<double> took =
+      std::chrono::steady_clock::now() - r.child.started;
+  latencies_.push_back(took.count());
+  if (latencies_.size() > 256)
+    latencies_.pop_front();
+  // The twin, if any, lost the race.
+  for (auto &other : active_)
+    if (other->task == j && !other->stopped)
+      stop(*other);
+}
+
+// How long a program may run before it is a straggler worth duplicating, or
+// 0 if there isn't enough history yet to tell.
+double supervisor::straggler_seconds() const {
+  if (speculate_ <= 0.0 || latencies_.size() < 8)
+    return 0.0;
+  std::vector<double> sorted(latencies_.begin(), latencies_.end());
+  auto middle = sorted.begin() + sorted.size() / 2;
+  std::nth_element(sorted.begin(), middle, sorted.end());
+  return speculate_ * *middle;
+}
+
+// Kills programs that have run past the timeout and duplicates stragglers.
+void supervisor::check_running() {
+  double timeout = launcher_.timeout();
+  double straggler = straggler_seconds();
+  if (timeout <= 0.0 && straggler <= 0.0)
+    return;
+  auto now = std::chrono::steady_clock::now();
+  auto candidates = active_;
+  for (auto &r : candidates) {
+    if (r->stopped)
+      continue;
+    std::chrono::duration<double> ran = now - r->child.started;
+    auto j = r->task;
+    if (timeout > 0.0 && ran.count() > timeout) {
+      stop(*r);
+      r->expired = true;
+      timeouts_++;
+      continue;
+    }
+    if (straggler > 0.0 && ran.count() > straggler && !j->speculated &&
+        !j->done) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!queue_.empty() || children_ >= in_flight_)
+          continue;
+      }
+      j->speculated = true;
+      launch(j);
+      speculations_++;
+    }
+  }
 }
 
-std::vector<double> sphere_dx(const std::vector<double> &v) {
-  std::vector<double> result(v.size());
-  for (size_t i = 0; i < v.size(); i++) {
-    result[i] = 2 * v[i];
+// Milliseconds until check_running() next has something to do, or -1.
+int supervisor::next_check() const {
+  double timeout = launcher_.timeout();
+  double straggler = straggler_seconds();
+  if (active_.empty() || (timeout <= 0.0 && straggler <= 0.0))
+    return -1;
+  int wait = -1;
+  for (auto &r : active_) {
+    if (r->stopped)
+      continue;
+    for (double limit : {timeout, r->task->speculated ? 0.0 : straggler}) {
+      if (limit <= 0.0)
+        continue;
+      auto due = r->child.started + std::chrono::microseconds(
+                                        static_cast<int64_t>(limit * 1e6));
+      int ms = millis_until(due) + 1;
+      if (wait < 0 || ms < wait)
+        wait = ms;
+    }
   }
-  return result;
+  return wait;
 }
 
-double rastrigin(const std::vector<double> &v) {
-  double total = 10 * v.size();
-  for (auto it = v.begin(); it != v.end(); it++) {
-    double term =
-        (10.0 + *it) * (10.0 + *it) - 10.0 * std::cos(2 * M_PI * (*it + 10.0));
-    total += term;
+// Collects the programs that have closed their stdout and exited, and
+// answers their jobs.
+void supervisor::reap() {
+  auto candidates = active_;
+  for (auto &r : candidates) {
+    int status;
+    if (r->child.out >= 0 || waitpid(r->child.pid, &status, WNOHANG) == 0)
+      continue;
+    active_.erase(std::find(active_.begin(), active_.end(), r));
+    children_--;
+    r->task->copies--;
+    finished(*r, status);
   }
-  return total;
 }
 
-double flipflop(const std::vector<double> &v) {
-  double total = 15.0;
-  for (auto it = v.begin(); it != v.end(); it++) {
-    total += *it;
+void supervisor::loop() {
+  // Programs that stop reading their stdin are written to from here.
+  sigpipe_blocker blocker;
+  const int max_events = 64;
+  epoll_event events[max_events];
+  for (;;) {
+    start_jobs();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_ && queue_.empty() && children_ == 0)
+        break;
+    }
+    // Poll rather than block while there are programs left to reap, and
+    // wake up in time to enforce the timeout and spot stragglers.
+    int timeout = next_check();
+    bool exiting = std::any_of(
+        active_.begin(), active_.end(),
+        [](const std::shared_ptr<running> &r) { return r->child.out < 0; });
+    if (exiting && (timeout < 0 || timeout > 1))
+      timeout = 1;
+    int n = epoll_wait(epoll_, events, max_events, timeout);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == wake_) {
+        eventfd_t count;
+        eventfd_read(wake_, &count);
+        continue;
+      }
+      auto it = by_fd_.find(fd);
+      if (it == by_fd_.end())
+        continue;
+      auto r = it->second;
+      if (fd == r->child.in)
+        write_input(*r);
+      else
+        read_output(*r);
+    }
+    check_running();
+    reap();
   }
-  return fabs(total);
 }
 
-// If an external program is being optimized this is the
-// function that must be called.
-external::external(std::string &command) : command_(command){};
+external_async::external_async(std::string &command, unsigned in_flight,
+                               const std::string &protocol, unsigned batch,
+                               const eval_limits &limits)
+    : supervisor_(std::make_shared<supervisor>(command, protocol == "binary",
+                                               in_flight, batch > 0, limits)),
+      batch_(std::max(batch, 1u)), penalty_(limits.penalty){};
 
-double external::operator()(const std::vector<double> &x_i) {
-  std::stringstream args;
-  bp::ipstream is;
-  args << " ";
-  for (auto x : x_i)
-    args << x << " ";
+double external_async::operator()(const std::vector<double> &x_i) {
+  try {
+    auto result = supervisor_->submit({x_i}).get();
+    return result.size() > 0 ? result[0] : NAN;
+  } catch (timed_out &) {
+    return penalty_;
+  }
+};
+
+std::vector<double>
+external_async::evaluate(const std::vector<std::vector<double>> &xs) {
+  std::vector<std::future<std::vector<double>>> replies;
+  std::vector<size_t> sizes;
+  for (size_t i = 0; i < xs.size(); i += batch_) {
+    std::vector<std::vector<double>> chunk(
+        xs.begin() + i, xs.begin() + std::min(xs.size(), i + batch_));
+    sizes.push_back(chunk.size());
+    replies.push_back(supervisor_->submit(chunk));
+  }
+  std::vector<double> results;
+  for (size_t i = 0; i < replies.size(); i++) {
+    std::vector<double> values;
+    try {
+      values = replies[i].get();
+    } catch (timed_out &) {
+      values.assign(sizes[i], penalty_);
+    }
+    if (values.size() < sizes[i]) {
+      std::string s = "program returned fewer values than it was sent: " +
+                      supervisor_->command();
+      throw std::runtime_error(s.c_str());
+    }
+    results.insert(results.end(), values.begin(),
+                   values.begin() + sizes[i]);
+  }
+  return results;
+}
+
+spawn_stats external_async::stats() const { return supervisor_->stats(); }
 
-  std::string cmd = command_ + " " + args.str();
+external_dx_async::external_dx_async(std::string &command, unsigned in_flight,
+                                     const std::string &protocol,
+                                     const eval_limits &limits)
+    : supervisor_(std::make_shared<supervisor>(command, protocol == "binary",
+                                               in_flight, false, limits)),
+      penalty_(limits.penalty){};
+
+std::vector<double>
+external_dx_async::operator()(const std::vector<double> &x_i) {
+  try {
+    return supervisor_->submit({x_i}).get();
+  } catch (timed_out &) {
+    return std::vector<double>(x_i.size(), penalty_);
+  }
+};
+
+spawn_stats external_dx_async::stats() const { return supervisor_->stats(); }
+
+// A long-lived model process. Vectors are written to its stdin, one per line
+// or one binary frame, and it answers each in kind on its stdout. A process
+// handles one vector at a time; worker_pool makes sure of that. If timeout is
+// not 0 and the whole reply hasn't arrived within that many seconds, the
+// process is killed and exchange() throws timed_out.
+class persistent_process {
+public:
+  persistent_process(const std::string &command, bool binary,
+                     double timeout = 0.0);
+  ~persistent_process();
+  std::vector<double> exchange(const std::vector<double> &x_i);
+
+private:
+  size_t reply_size(size_t max) const;
+  size_t read_reply(size_t max);
+  std::string command_;
+  bool binary_;
+  double timeout_;
+  bp::opstream in_;
+  bp::pipe out_; // read directly, so that a deadline covers every byte
+  std::string buffer_; // read from the model but not yet taken as a reply
+  bp::group group_;
+  bp::child child_;
+};
+
+persistent_process::persistent_process(const std::string &command,
+                                       bool binary, double timeout)
+    : command_(command), binary_(binary), timeout_(timeout) {
+  // Other models started later must not inherit this one's pipes, or it
+  // won't see end of file on stdin when fit is done with it.
+  for (int fd : {in_.pipe().native_source(), in_.pipe().native_sink(),
+                 out_.native_source(), out_.native_sink()})
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
   try {
-    bp::system(cmd, bp::std_out > is);
+    // As with launcher, a model that may be killed gets a process group of
+    // its own.
+    if (timeout_ > 0.0)
+      child_ = bp::child(command_, bp::std_in < in_, bp::std_out > out_,
+                         group_);
+    else
+      child_ = bp::child(command_, bp::std_in < in_, bp::std_out > out_);
   } catch (boost::process::process_error &e) {
     std::string s = "can't call program: " + command_;
     throw std::runtime_error(s.c_str());
   }
-  double result;
-  is >> result;
+}
+
+// Gives a model that has been told to exit a second to do so before
+// killing it.
+static void stop_child(bp::child &child) {
+  std::error_code ec;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while (child.running(ec) && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  if (child.running(ec))
+    child.terminate(ec);
+}
+
+persistent_process::~persistent_process() {
+  // Closing the model's stdin is its signal to exit.
+  in_.pipe().close();
+  stop_child(child_);
+}
+
+// The length of the reply at the start of buffer_, a line or a frame of at
+// most max values, or 0 if it isn't all there yet.
+size_t persistent_process::reply_size(size_t max) const {
+  if (!binary_) {
+    size_t end = buffer_.find('\n');
+    return end == std::string::npos ? 0 : end + 1;
+  }
+  if (buffer_.size() < 4)
+    return 0;
+  uint32_t n = 0;
+  for (size_t b = 0; b < 4; b++)
+    n |= (uint32_t)(unsigned char)buffer_[b] << (8 * b);
+  if (n > max) {
+    std::string s = "program stopped responding: " + command_;
+    throw std::runtime_error(s.c_str());
+  }
+  return buffer_.size() < 4 + 8 * (size_t)n ? 0 : 4 + 8 * (size_t)n;
+}
+
+// Reads until buffer_ starts with a whole reply and returns its length, or
+// 0 if the model closed its stdout first. With a timeout, a model that
+// hasn't sent all of it in time, whether or not it has started, is killed.
+size_t persistent_process::read_reply(size_t max) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::microseconds(
+                      static_cast<int64_t>(timeout_ * 1e6));
+  char chunk[4096];
+  for (;;) {
+    if (size_t size = reply_size(max))
+      return size;
+    if (timeout_ > 0.0) {
+      pollfd p{out_.native_source(), POLLIN, 0};
+      int n;
+      while ((n = poll(&p, 1, millis_until(deadline))) < 0 && errno == EINTR)
+        ;
+      if (n == 0) {
+        std::error_code ec;
+        group_.terminate(ec);
+        std::string s = "program timed out: " + command_;
+        throw timed_out(s.c_str());
+      }
+    }
+    ssize_t n = read(out_.native_source(), chunk, sizeof chunk);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      // A last line without its newline is still a reply.
+      return binary_ ? 0 : buffer_.size();
+    buffer_.append(chunk, n);
+  }
+}
+
+std::vector<double>
+persistent_process::exchange(const std::vector<double> &x_i) {
+  std::vector<double> result;
+  bool ok;
+  {
+    // A model that dies mid-run must surface as an error, not kill fit.
+    sigpipe_blocker blocker;
+    if (binary_) {
+      write_frame(in_, x_i);
+    } else {
+      in_ << text_args(x_i) << std::endl;
+    }
+  }
+  size_t max = std::max<size_t>(x_i.size(), 1);
+  size_t size = in_ ? read_reply(max) : 0;
+  ok = size > 0;
+  if (ok) {
+    std::string reply = buffer_.substr(0, size);
+    buffer_.erase(0, size);
+    if (binary_) {
+      std::istringstream is(reply);
+      ok = read_frame(is, result, max);
+    } else {
+      result = parse_values(reply, command_);
+    }
+  }
+  if (!ok) {
+    std::string s = "program stopped responding: " + command_;
+    throw std::runtime_error(s.c_str());
+  }
   return result;
+}
+
+// Up to size model processes shared by all the optimizer threads. Processes
+// are started the first time they are needed, so single threaded methods
+// only ever start one. A process that dies is replaced and the vector it
+// was evaluating is sent to the replacement. One that times out is replaced
+// too, but its vector is not retried.
+class worker_pool {
+public:
+  worker_pool(const std::string &command, bool binary, unsigned size,
+              double timeout = 0.0);
+  std::vector<double> exchange(const std::vector<double> &x_i);
+  unsigned timeouts() const { return timeouts_; }
+
+private:
+  std::unique_ptr<persistent_process> acquire();
+  void release(std::unique_ptr<persistent_process> worker);
+  std::string command_;
+  bool binary_;
+  unsigned size_;
+  double timeout_;
+  std::atomic<unsigned> timeouts_{0};
+  unsigned started_ = 0;
+  std::vector<std::unique_ptr<persistent_process>> idle_;
+  std::mutex mutex_;
+  std::condition_variable available_;
 };
 
-external_dx::external_dx(std::string &command) : command_(command){};
+worker_pool::worker_pool(const std::string &command, bool binary,
+                         unsigned size, double timeout)
+    : command_(command), binary_(binary), size_(std::max(size, 1u)),
+      timeout_(timeout) {}
+
+std::unique_ptr<persistent_process> worker_pool::acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  available_.wait(lock, [this] { return !idle_.empty() || started_ < size_; });
+  if (!idle_.empty()) {
+    auto worker = std::move(idle_.back());
+    idle_.pop_back();
+    return worker;
+  }
+  started_++;
+  lock.unlock();
+  try {
+    return std::make_unique<persistent_process>(command_, binary_, timeout_);
+  } catch (...) {
+    lock.lock();
+    started_--;
+    available_.notify_one();
+    throw;
+  }
+}
 
-// If an external program is being optimized  and it also has an external
-// gradient function this is the function that must be called.
-std::vector<double> external_dx::operator()(const std::vector<double> &x_i) {
-  std::stringstream args;
-  bp::ipstream is;
-  args << " ";
-  for (auto x : x_i)
-    args << x << " ";
+void worker_pool::release(std::unique_ptr<persistent_process> worker) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (worker)
+    idle_.push_back(std::move(worker));
+  else
+    started_--;
+  available_.notify_one();
+}
+
+std::vector<double> worker_pool::exchange(const std::vector<double> &x_i) {
+  auto worker = acquire();
+  try {
+    auto reply = worker->exchange(x_i);
+    release(std::move(worker));
+    return reply;
+  } catch (timed_out &) {
+    timeouts_++;
+    release(nullptr);
+    throw;
+  } catch (std::runtime_error &) {
+  }
+  // The worker crashed. Restart it and give it one more try.
+  try {
+    worker =
+        std::make_unique<persistent_process>(command_, binary_, timeout_);
+    auto reply = worker->exchange(x_i);
+    release(std::move(worker));
+    return reply;
+  } catch (timed_out &) {
+    timeouts_++;
+    release(nullptr);
+    throw;
+  } catch (...) {
+    release(nullptr);
+    throw;
+  }
+}
+
+external_persistent::external_persistent(std::string &command,
+                                         unsigned workers,
+                                         const std::string &protocol,
+                                         const eval_limits &limits)
+    : pool_(std::make_shared<worker_pool>(command, protocol == "binary",
+                                          workers, limits.timeout)),
+      penalty_(limits.penalty){};
+
+double external_persistent::operator()(const std::vector<double> &x_i) {
+  try {
+    auto result = pool_->exchange(x_i);
+    return result.size() > 0 ? result[0] : NAN;
+  } catch (timed_out &) {
+    return penalty_;
+  }
+};
+
+spawn_stats external_persistent::stats() const {
+  spawn_stats s;
+  s.timeouts = pool_->timeouts();
+  return s;
+}
+
+external_dx_persistent::external_dx_persistent(std::string &command,
+                                               unsigned workers,
+                                               const std::string &protocol,
+                                               const eval_limits &limits)
+    : pool_(std::make_shared<worker_pool>(command, protocol == "binary",
+                                          workers, limits.timeout)),
+      penalty_(limits.penalty){};
+
+std::vector<double>
+external_dx_persistent::operator()(const std::vector<double> &x_i) {
+  try {
+    return pool_->exchange(x_i);
+  } catch (timed_out &) {
+    return std::vector<double>(x_i.size(), penalty_);
+  }
+};
+
+spawn_stats external_dx_persistent::stats() const {
+  spawn_stats s;
+  s.timeouts = pool_->timeouts();
+  return s;
+}
+
+// The optimizer side of the shared memory ring described in fit_shm.h. Any
+// number of threads may call exchange() at once; each takes a ticket, waits
+// for its slot to come round, posts its vector and waits for the reply. A
+// batch takes a run of tickets and rings the doorbell once for all of them.
+class shm_ring {
+public:
+  shm_ring(const std::string &command, size_t capacity, unsigned workers);
+  ~shm_ring();
+  std::vector<double> exchange(const std::vector<double> &x_i);
+  std::vector<std::vector<double>>
+  exchange(const std::vector<std::vector<double>> &xs);
+
+private:
+  template <typename Ready> void wait(fit_shm_slot *slot, Ready ready);
+  void check_size(const std::vector<double> &x) const;
+  fit_shm_slot *post(uint32_t ticket, const std::vector<double> &x);
+  void ring_doorbell();
+  std::vector<double> collect(uint32_t ticket, fit_shm_slot *slot);
+  void check_workers();
+  void close();
+  std::string command_;
+  std::string name_;
+  fit_shm_header *header_ = nullptr;
+  size_t size_ = 0;
+  std::vector<bp::child> children_;
+  std::mutex children_mutex_;
+};
+
+shm_ring::shm_ring(const std::string &command, size_t capacity,
+                   unsigned workers)
+    : command_(command) {
+  static std::atomic_uint rings(0);
+  name_ = "/fit-" + std::to_string(getpid()) + "-" + std::to_string(rings++);
+  // A power of two number of slots keeps ticket % slots and ticket / slots
+  // consistent when the 32 bit ticket counters wrap.
+  unsigned slots = 16;
+  while (slots < 4 * workers)
+    slots *= 2;
+  size_ = fit_shm_size(slots, capacity);
+
+  int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    std::string s = "can't create shared memory " + name_;
+    throw std::runtime_error(s.c_str());
+  }
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, size_) == 0)
+    p = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(name_.c_str());
+    std::string s = "can't map shared memory " + name_;
+    throw std::runtime_error(s.c_str());
+  }
+  // ftruncate zero fills, so every slot starts empty on lap 0.
+  header_ = (fit_shm_header *)p;
+  header_->slots = slots;
+  header_->capacity = capacity;
+  fit_shm_store(&header_->magic, FIT_SHM_MAGIC);
 
-  std::string cmd = command_ + " " + args.str();
   try {
-    bp::system(cmd, bp::std_out > is);
+    for (unsigned i = 0; i < std::max(workers, 1u); i++)
+      children_.emplace_back(command_, bp::env[FIT_SHM_ENV] = name_);
   } catch (boost::process::process_error &e) {
+    close();
     std::string s = "can't call program: " + command_;
     throw std::runtime_error(s.c_str());
   }
+}
 
-  std::vector<double> result;
+shm_ring::~shm_ring() { close(); }
 
-  double d;
-  while (is >> d)
-    result.push_back(d);
+void shm_ring::close() {
+  fit_shm_store(&header_->closed, 1);
+  fit_shm_add(&header_->doorbell, 1);
+  fit_shm_wake(&header_->doorbell);
+  for (auto &child : children_)
+    stop_child(child);
+  munmap(header_, size_);
+  shm_unlink(name_.c_str());
+}
+
+void shm_ring::check_workers() {
+  std::lock_guard<std::mutex> lock(children_mutex_);
+  std::error_code ec;
+  for (auto &child : children_) {
+    if (!child.running(ec)) {
+      std::string s = "program stopped responding: " + command_;
+      throw std::runtime_error(s.c_str());
+    }
+  }
+}
+
+// Spins for a while, as the reply from a fast model is usually only a few
+// hundred nanoseconds away, then sleeps on the slot's futex. The sleep times
+// out now and then so that a model that has died is noticed.
+template <typename Ready> void shm_ring::wait(fit_shm_slot *slot, Ready ready) {
+  for (unsigned spins = 0; !ready(); spins++) {
+    if (spins < FIT_SHM_SPINS)
+      continue;
+    uint32_t state = fit_shm_load(&slot->state);
+    if (ready())
+      break;
+    fit_shm_add(&slot->waiting, 1);
+    fit_shm_wait(&slot->state, state, 100000000L);
+    fit_shm_add(&slot->waiting, -1);
+    if (!ready())
+      check_workers();
+  }
+}
+
+// Checked before taking a ticket: a ticket that is never posted would
+// stall the ring.
+void shm_ring::check_size(const std::vector<double> &x) const {
+  if (x.size() > header_->capacity) {
+    throw std::invalid_argument("vector is larger than the shared memory "
+                                "slots");
+  }
+}
+
+// Waits for the slot of ticket to come round and posts x to it, without
+// ringing the doorbell.
+fit_shm_slot *shm_ring::post(uint32_t ticket, const std::vector<double> &x) {
+  uint32_t lap = ticket / header_->slots;
+  fit_shm_slot *slot = fit_shm_slot_at(header_, ticket);
+  wait(slot, [slot, lap] {
+    return fit_shm_load(&slot->state) == FIT_SHM_EMPTY &&
+           fit_shm_load(&slot->lap) == lap;
+  });
+  std::copy(x.begin(), x.end(), fit_shm_request(slot));
+  slot->n = x.size();
+  fit_shm_store(&slot->state, FIT_SHM_REQUEST);
+  return slot;
+}
+
+void shm_ring::ring_doorbell() {
+  fit_shm_add(&header_->doorbell, 1);
+  if (fit_shm_load(&header_->sleepers))
+    fit_shm_wake(&header_->doorbell);
+}
+
+// Waits for the reply to ticket and hands its slot over to whoever has the
+// ticket one lap on.
+std::vector<double> shm_ring::collect(uint32_t ticket, fit_shm_slot *slot) {
+  wait(slot, [slot] { return fit_shm_load(&slot->state) == FIT_SHM_DONE; });
+  double *reply = fit_shm_reply_data(header_, slot);
+  std::vector<double> result(reply, reply + slot->m);
+  fit_shm_store(&slot->lap,
+                (uint32_t)(ticket + header_->slots) / header_->slots);
+  fit_shm_store(&slot->state, FIT_SHM_EMPTY);
+  if (fit_shm_load(&slot->waiting))
+    fit_shm_wake(&slot->state);
+  return result;
+}
+
+std::vector<double> shm_ring::exchange(const std::vector<double> &x_i) {
+  check_size(x_i);
+  uint32_t ticket = fit_shm_add(&header_->tail, 1);
+  fit_shm_slot *slot = post(ticket, x_i);
+  ring_doorbell();
+  return collect(ticket, slot);
+}
+
+// Takes a run of tickets at once, posts all of their vectors and wakes the
+// models once. The run is at most half the ring, so a batch never waits on
+// a slot it holds itself and other threads still get a look in.
+std::vector<std::vector<double>>
+shm_ring::exchange(const std::vector<std::vector<double>> &xs) {
+  for (auto &x : xs)
+    check_size(x);
+  std::vector<std::vector<double>> results;
+  size_t run = std::max(header_->slots / 2, 1u);
+  for (size_t i = 0; i < xs.size(); i += run) {
+    size_t k = std::min(run, xs.size() - i);
+    uint32_t first = fit_shm_add(&header_->tail, k);
+    std::vector<fit_shm_slot *> slots;
+    for (size_t j = 0; j < k; j++)
+      slots.push_back(post(first + j, xs[i + j]));
+    ring_doorbell();
+    for (size_t j = 0; j < k; j++)
+      results.push_back(collect(first + j, slots[j]));
+  }
+  return results;
+}
+
+external_shm::external_shm(std::string &command, size_t variables,
+                           unsigned workers)
+    : ring_(std::make_shared<shm_ring>(command, variables, workers)){};
+
+double external_shm::operator()(const std::vector<double> &x_i) {
+  auto result = ring_->exchange(x_i);
+  return result.size() > 0 ? result[0] : NAN;
+};
+
+std::vector<double>
+external_shm::evaluate(const std::vector<std::vector<double>> &xs) {
+  std::vector<double> values;
+  for (auto &result : ring_->exchange(xs))
+    values.push_back(result.size() > 0 ? result[0] : NAN);
+  return values;
+}
+
+external_dx_shm::external_dx_shm(std::string &command, size_t variables,
+                                 unsigned workers)
+    : ring_(std::make_shared<shm_ring>(command, variables, workers)){};
+
+std::vector<double>
+external_dx_shm::operator()(const std::vector<double> &x_i) {
+  return ring_->exchange(x_i);
+};
+
+// Keeps a plugin's shared library loaded, and its context alive, for as long
+// as any copy of the plugin or plugin_dx that uses it.
+class plugin_library {
+public:
+  plugin_library(const std::string &spec, size_t variables);
+  ~plugin_library();
+  void *symbol = nullptr;
+  void *ctx = nullptr;
+
+private:
+  void *handle_ = nullptr;
+  fit_plugin_teardown teardown_ = nullptr;
+};
+
+plugin_library::plugin_library(const std::string &spec, size_t variables) {
+  // The path may itself contain colons, so the symbol is whatever follows
+  // the last one.
+  const std::string prefix = "plugin:";
+  size_t colon = spec.rfind(':');
+  if (spec.rfind(prefix, 0) != 0 || colon < prefix.size() + 1 ||
+      colon + 1 == spec.size()) {
+    std::string s = "plugin must be given as plugin:path:symbol, not " + spec;
+    throw std::invalid_argument(s);
+  }
+  std::string path = spec.substr(prefix.size(), colon - prefix.size());
+  std::string name = spec.substr(colon + 1);
+
+  handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle_ == nullptr) {
+    std::string s = "can't load plugin: " + std::string(dlerror());
+    throw std::runtime_error(s.c_str());
+  }
+  symbol = dlsym(handle_, name.c_str());
+  if (symbol == nullptr) {
+    dlclose(handle_);
+    std::string s = "can't find " + name + " in plugin " + path;
+    throw std::runtime_error(s.c_str());
+  }
+  auto init = (fit_plugin_init)dlsym(handle_, (name + "_init").c_str());
+  teardown_ =
+      (fit_plugin_teardown)dlsym(handle_, (name + "_teardown").c_str());
+  if (init)
+    ctx = init(variables);
+}
+
+plugin_library::~plugin_library() {
+  if (teardown_)
+    teardown_(ctx);
+  dlclose(handle_);
+}
+
+plugin::plugin(const std::string &spec, size_t variables)
+    : lib_(std::make_shared<plugin_library>(spec, variables)){};
+
+double plugin::operator()(const std::vector<double> &x_i) {
+  return (*this)(x_i.data(), x_i.size());
+};
+
+double plugin::operator()(const double *x, size_t n) {
+  auto f = (fit_plugin_func)lib_->symbol;
+  return f(n, x, lib_->ctx);
+};
+
+plugin_dx::plugin_dx(const std::string &spec, size_t variables)
+    : lib_(std::make_shared<plugin_library>(spec, variables)){};
+
+std::vector<double> plugin_dx::operator()(const std::vector<double> &x_i) {
+  std::vector<double> result(x_i.size());
+  (*this)(x_i.data(), x_i.size(), result.data());
   return result;
 };
 
+void plugin_dx::operator()(const double *x, size_t n, double *dx) {
+  auto f = (fit_plugin_dx)lib_->symbol;
+  f(n, x, dx, lib_->ctx);
+};
+
 // Mean squared error. Sometimes it makes sense to make this the function
 // to be minimized.
 
@@ -258,6 +3115,35 @@ void Parameters::print() {
   std::cout << "Domains: " << domains << "\n";
   std::cout << "Verbose: " << verbose << "\n";
   std::cout << "Threads: " << threads << "\n";
+  if (func_name == "external-persistent" || dx_name == "external-persistent" ||
+      func_name == "external-shm" || dx_name == "external-shm") {
+    std::cout << "Workers: " << workers << "\n";
+  }
+  if (func_name == "external-async" || dx_name == "external-async") {
+    std::cout << "In flight: " << in_flight << "\n";
+  }
+  if (func_name == "external" || func_name == "external-async") {
+    std::cout << "External batch: " << external_batch << "\n";
+  }
+  if (batch > 0) {
+    std::cout << "Batch: " << batch << "\n";
+  }
+  if (func_name == "external" || dx_name == "external" ||
+      func_name == "external-async" || dx_name == "external-async" ||
+      func_name == "external-persistent" || dx_name == "external-persistent") {
+    std::cout << "Protocol: " << protocol << "\n";
+  }
+  if (timeout > 0.0) {
+    std::cout << "Timeout: " << timeout << "\n";
+    std::cout << "Penalty: " << penalty << "\n";
+  }
+  if (speculate > 0.0) {
+    std::cout << "Speculate: " << speculate << "\n";
+  }
+  if (func_name == "sphere" || func_name == "rastrigin" ||
+      func_name == "flipflop" || dx_name == "sphere_dx") {
+    std::cout << "SIMD: " << simd_level() << "\n";
+  }
   std::cout << "Iterations: " << iterations << "\n";
   if (method == "grid" || method == "random" || method == "nms") {
     std::cout << "Error: " << error << "\n";
@@ -267,6 +3153,31 @@ void Parameters::print() {
     std::cout << "Generations: " << generations << "\n";
     std::cout << "Passes: " << passes << "\n";
   }
+  if (seed)
+    std::cout << "Seed: " << *seed << "\n";
+  else
+    std::cout << "Seed: random\n";
+  if (cache > 0) {
+    std::cout << "Cache (MB): " << cache << "\n";
+    std::cout << "Cache quantum: " << cache_quantum << "\n";
+  }
+  if (store != "") {
+    std::cout << "Store: " << store << "\n";
+    std::cout << "Store tag: " << store_tag << "\n";
+  }
+  if (reuse_radius > 0.0) {
+    std::cout << "Reuse radius: " << reuse_radius << "\n";
+  }
+  if (checkpoint != "") {
+    std::cout << "Checkpoint: " << checkpoint << "\n";
+    std::cout << "Checkpoint interval: " << checkpoint_interval << "\n";
+  }
+  if (resume != "") {
+    std::cout << "Resume: " << resume << "\n";
+  }
+  if (log != "") {
+    std::cout << "Log: " << log << "\n";
+  }
   if (method == "gradient") {
     std::cout << "Step size: " << step_size << "\n";
     std::cout << "Tolerance: " << tol << "\n";
@@ -274,44 +3185,147 @@ void Parameters::print() {
   }
 }
 
-Optimization::Optimization(const Parameters &p)
-    : parameters(p), func_calls_(0) {
+// An external functor's evaluate() as a batch function.
+template <typename F> static opt_func_batch evaluate_batch(F f) {
+  return [f](const double *xs, size_t m, size_t n, double *ys) mutable {
+    std::vector<std::vector<double>> rows(m);
+    for (size_t i = 0; i < m; i++)
+      rows[i].assign(xs + i * n, xs + (i + 1) * n);
+    auto values = f.evaluate(rows);
+    std::copy(values.begin(), values.begin() + std::min(values.size(), m), ys);
+  };
+}
 
-  Fit::make_divisions(parameters);
-  Fit::make_domains(parameters);
-  original_domains_ = parameters.domains;
-  if (parameters.func_name == "external") {
-    external e(parameters.command);
+Optimization::Optimization(const Parameters &p)
+    : basic_optimization(p, opt_func_ptr(), opt_func_dx_ptr()) {
+  if (parameters.func_name == "external" && parameters.command != "") {
+    external e(parameters.command, parameters.protocol,
+               parameters.external_batch, limits());
+    parameters.func = e;
+    // Unbatched, evaluate() would start the programs one after another,
+    // where the pool runs one per thread.
+    if (parameters.external_batch > 0)
+      parameters.func_batch = evaluate_batch(e);
+  }
+  if (parameters.dx_name == "external" && parameters.command_dx != "") {
+    external_dx e(parameters.command_dx, parameters.protocol, limits());
+    parameters.dx = e;
+  }
+  if (parameters.func_name == "external-async" && parameters.command != "") {
+    external_async e(parameters.command, in_flight(), parameters.protocol,
+                     parameters.external_batch, limits());
+    parameters.func = e;
+    parameters.func_batch = evaluate_batch(e);
+  }
+  if (parameters.dx_name == "external-async" && parameters.command_dx != "") {
+    external_dx_async e(parameters.command_dx, in_flight(),
+                        parameters.protocol, limits());
+    parameters.dx = e;
+  }
+  if (parameters.func_name == "external-persistent" &&
+      parameters.command != "") {
+    external_persistent e(parameters.command, workers(), parameters.protocol,
+                          limits());
+    parameters.func = e;
+  }
+  if (parameters.dx_name == "external-persistent" &&
+      parameters.command_dx != "") {
+    external_dx_persistent e(parameters.command_dx, workers(),
+                             parameters.protocol, limits());
+    parameters.dx = e;
+  }
+  if (parameters.func_name == "external-shm" && parameters.command != "") {
+    external_shm e(parameters.command, parameters.domains.size(), workers());
+    parameters.func = e;
+    parameters.func_batch = evaluate_batch(e);
+  }
+  if (parameters.dx_name == "external-shm" && parameters.command_dx != "") {
+    external_dx_shm e(parameters.command_dx, parameters.domains.size(),
+                      workers());
+    parameters.dx = e;
+  }
+  if (parameters.func_name.rfind("plugin:", 0) == 0) {
+    plugin e(parameters.func_name, parameters.domains.size());
     parameters.func = e;
+    parameters.func_ptr = e;
   }
-  if (parameters.dx_name == "external") {
-    external_dx e(parameters.command_dx);
+  if (parameters.dx_name.rfind("plugin:", 0) == 0) {
+    plugin_dx e(parameters.dx_name, parameters.domains.size());
     parameters.dx = e;
+    parameters.dx_ptr = e;
+  }
+  if (!parameters.func && parameters.func_ptr) {
+    parameters.func = vector_adapter(parameters.func_ptr);
+  }
+  if (!parameters.func && parameters.func_batch) {
+    parameters.func = point_adapter(parameters.func_batch);
+  }
+  if (!parameters.func_ptr && parameters.func) {
+    parameters.func_ptr = pointer_adapter(parameters.func);
   }
+  if (!parameters.dx && parameters.dx_ptr) {
+    parameters.dx = vector_adapter_dx(parameters.dx_ptr);
+  }
+  if (!parameters.dx_ptr && parameters.dx) {
+    parameters.dx_ptr = pointer_adapter_dx(parameters.dx);
+  }
+  func_ = parameters.func_ptr;
+  dx_ = parameters.dx_ptr;
   if (parameters.verbose) {
     parameters.print();
   }
 }
 
-double Optimization::exec_func(const std::vector<double> &x) {
-  func_calls_++;
-  return parameters.func(x);
+// Number of model processes to keep for the external-persistent functions.
+unsigned Optimization::workers() const {
+  return parameters.workers > 0 ? parameters.workers : parameters.threads;
+}
+
+eval_limits Optimization::limits() const {
+  eval_limits l;
+  l.timeout = parameters.timeout;
+  l.penalty = parameters.penalty;
+  l.speculate = parameters.speculate;
+  return l;
 }
 
 Result Optimization::optimize() {
   if (parameters.check == true)
     check();
-  if (parameters.method == "random") {
-    return random();
-  } else if (parameters.method == "grid") {
-    return grid();
-  } else if (parameters.method == "nms") {
-    return nelder_mead_simplex();
-  } else if (parameters.method == "gradient") {
-    return gradient_descent();
-  } else {
-    std::string msg = "unknown optimization method " + parameters.method;
-    throw std::invalid_argument(msg);
+  Result result = basic_optimization::optimize();
+  add_spawn_stats(result);
+  return result;
+}
+
+// Reports how long it took to start external programs, if any were used,
+// and how many evaluations timed out or were duplicated.
+void Optimization::add_spawn_stats(Result &result) const {
+  spawn_stats total;
+  const external *f = parameters.func.target<external>();
+  const external_dx *dx = parameters.dx.target<external_dx>();
+  const external_async *fa = parameters.func.target<external_async>();
+  const external_dx_async *dxa = parameters.dx.target<external_dx_async>();
+  const external_persistent *fp = parameters.func.target<external_persistent>();
+  const external_dx_persistent *dxp =
+      parameters.dx.target<external_dx_persistent>();
+  for (auto s : {f ? f->stats() : spawn_stats(),
+                 dx ? dx->stats() : spawn_stats(),
+                 fa ? fa->stats() : spawn_stats(),
+                 dxa ? dxa->stats() : spawn_stats(),
+                 fp ? fp->stats() : spawn_stats(),
+                 dxp ? dxp->stats() : spawn_stats()}) {
+    total.spawns += s.spawns;
+    total.spawn_seconds += s.spawn_seconds;
+    total.call_seconds += s.call_seconds;
+    total.timeouts += s.timeouts;
+    total.speculations += s.speculations;
+  }
+  result.spawns = total.spawns;
+  result.timeouts = total.timeouts;
+  result.speculations = total.speculations;
+  if (total.spawns > 0) {
+    result.spawn_latency = total.spawn_seconds / total.spawns;
+    result.call_latency = total.call_seconds / total.spawns;
   }
 }
 
@@ -319,245 +3333,59 @@ void Result::print() {
   std::cout << "Best vector: " << best << "\n";
   std::cout << "Minimum found: " << lowest << "\n";
   std::cout << "Function calls: " << calls << "\n";
-}
-
-Result Optimization::random() {
-  bool lowest_found = false;
-  double lowest = std::numeric_limits<float>::max();
-  std::vector<double> best;
-  for (unsigned i = 0; i < parameters.iterations && lowest_found == false;
-       i++) {
-    std::vector<double> v(parameters.domains.size());
-    for (size_t j = 0; j < parameters.domains.size(); j++) {
-      std::uniform_real_distribution<double> dist(parameters.domains[j].first,
-                                                  parameters.domains[j].second);
-      v[j] = dist(rng);
-    }
-    double d = exec_func(v);
-    if (d < lowest) {
-      lowest = d;
-      best = v;
-      if (lowest < parameters.error) {
-        lowest_found = true;
-      }
-    }
-  }
-  return {lowest, best, func_calls_};
-}
-
-void Optimization::single_pass(
-    unsigned pass_no, unsigned thread_no, const std::vector<double> &step_size,
-    std::vector<std::pair<double, std::vector<double>>> &results) {
-  std::vector<double> begin(parameters.domains.size());
-
-  for (size_t i = 0; i < parameters.domains.size(); i++) {
-    begin[i] = std::min(parameters.domains[i].first +
-                            (double)pass_no / parameters.passes * step_size[i],
-                        original_domains_[i].second);
-  }
-  std::vector<double> best(parameters.domains.size());
-  double lowest = std::numeric_limits<float>::max();
-  for (size_t i = 0; i < parameters.domains.size() && lowest > parameters.error;
-       i++) {
-    std::vector<double> v(parameters.domains.size());
-    for (size_t j = 0; j < i; j++) {
-      v[j] = best[j];
-    }
-    v[i] = begin[i];
-    for (size_t j = i + 1;
-         j < parameters.domains.size() && lowest > parameters.error; j++) {
-      std::uniform_real_distribution<double> dist(parameters.domains[j].first,
-                                                  parameters.domains[j].second);
-      v[j] = dist(rng);
-    }
-    lowest = std::numeric_limits<float>::max();
-    for (size_t j = 0; j < parameters.divisions[i]; j++) {
-      double f = exec_func(v);
-      if (f < lowest) {
-        lowest = f;
-        best = v;
-      }
-      v[i] = std::min(v[i] + step_size[i], original_domains_[i].second);
-    }
-  }
-  results[thread_no] = {lowest, best};
-}
-
-Result Optimization::grid() {
-  if (parameters.divisions.size() != parameters.domains.size()) {
-    throw std::invalid_argument("Number of divisions must be 1 or equal to "
-                                "number of domains.");
-  }
-  std::vector<double> best_ever(parameters.domains.size());
-  double lowest_ever = std::numeric_limits<float>::max();
-  std::vector<double> step_size(parameters.domains.size());
-
-  for (unsigned g = 0;
-       g < parameters.generations && lowest_ever > parameters.error; g++) {
-    if (g > 0) {
-      for (size_t i = 0; i < parameters.domains.size(); i++) {
-        parameters.domains[i] = {
-            std::max(best_ever[i] - step_size[i], original_domains_[i].first),
-            std::min(best_ever[i] + step_size[i], original_domains_[i].second)};
-      }
-    }
-    for (size_t i = 0; i < step_size.size(); i++) {
-      step_size[i] =
-          (parameters.domains[i].second - parameters.domains[i].first) /
-          parameters.divisions[i];
-    }
-    unsigned p = 0;
-    while (p < parameters.passes && lowest_ever > parameters.error) {
-      std::vector<std::pair<double, std::vector<double>>> results(
-          std::min(parameters.threads, parameters.passes - p));
-      std::vector<std::thread> threads;
-      unsigned j = 0;
-      while (j < parameters.threads && p < parameters.passes &&
-             lowest_ever > parameters.error) {
-        threads.push_back(std::thread([this, p, j, step_size, &results] {
-          single_pass(p, j, step_size, results);
-        }));
-        j++;
-        p++;
-      }
-      for (auto &t : threads) {
-        t.join();
-      }
-      for (auto &r : results) {
-        if (r.first < lowest_ever) {
-          lowest_ever = r.first;
-          best_ever = r.second;
-        }
-      }
-    }
+  if (spawns > 0) {
+    std::cout << "Programs started: " << spawns << "\n";
+    std::cout << "Mean spawn latency (us): " << spawn_latency * 1e6 << "\n";
+    std::cout << "Mean call latency (us): " << call_latency * 1e6 << "\n";
   }
-  return {lowest_ever, best_ever, func_calls_};
-}
-
-double Optimization::exec_func_gsl(const gsl_vector *v, void *params) {
-  std::vector<double> v_copy(v->data, v->data + v->size);
-  Optimization *o = (Optimization *)params;
-  return o->exec_func(v_copy);
-}
-void Optimization::exec_func_gsl_df(const gsl_vector *v, void *params,
-                                    gsl_vector *df) {
-  std::vector<double> v_copy(v->data, v->data + v->size);
-  Optimization *o = (Optimization *)params;
-  auto df_vec = o->parameters.dx(v_copy);
-  for (size_t i = 0; i < df_vec.size(); i++) {
-    gsl_vector_set(df, i, df_vec[i]);
-  }
-}
-
-void Optimization::exec_func_gsl_combined(const gsl_vector *x, void *params,
-                                          double *f, gsl_vector *df) {
-  *f = exec_func_gsl(x, params);
-  exec_func_gsl_df(x, params, df);
-}
-
-Result Optimization::nelder_mead_simplex() {
-  const gsl_multimin_fminimizer_type *T = gsl_multimin_fminimizer_nmsimplex2;
-  gsl_multimin_fminimizer *s = NULL;
-  gsl_vector *ss, *x;
-  gsl_multimin_function minex_func;
-
-  size_t iter = 0;
-  int status;
-
-  /* Starting point */
-  x = gsl_vector_alloc(parameters.domains.size());
-  for (size_t i = 0; i < parameters.domains.size(); i++) {
-    std::uniform_real_distribution<double> dist(parameters.domains[i].first,
-                                                parameters.domains[i].second);
-    gsl_vector_set(x, i, dist(rng));
+  if (timeouts > 0)
+    std::cout << "Timed out evaluations: " << timeouts << "\n";
+  if (speculations > 0)
+    std::cout << "Speculative launches: " << speculations << "\n";
+  if (cache_hits > 0 || cache_misses > 0) {
+    std::cout << "Cache hits: " << cache_hits << "\n";
+    std::cout << "Cache misses: " << cache_misses << "\n";
   }
-
-  /* Set initial step sizes to 1 */
-  ss = gsl_vector_alloc(parameters.domains.size());
-  gsl_vector_set_all(ss, 1.0);
-
-  /* Initialize method and iterate */
-  minex_func.n = parameters.domains.size();
-  minex_func.f = exec_func_gsl;
-  minex_func.params = this;
-
-  s = gsl_multimin_fminimizer_alloc(T, parameters.domains.size());
-  gsl_multimin_fminimizer_set(s, &minex_func, x, ss);
-
-  do {
-    iter++;
-    status = gsl_multimin_fminimizer_iterate(s);
-
-    if (status)
-      break;
-
-    double size = gsl_multimin_fminimizer_size(s);
-    status = gsl_multimin_test_size(size, parameters.error);
-  } while (status == GSL_CONTINUE && iter < parameters.iterations);
-
-  gsl_vector_free(x);
-  gsl_vector_free(ss);
-  double lowest = s->fval;
-  std::vector<double> best(s->x->data, s->x->data + s->x->size);
-  gsl_multimin_fminimizer_free(s);
-  return {lowest, best, func_calls_};
-}
-
-Result Optimization::gradient_descent() {
-  const gsl_multimin_fdfminimizer_type *T;
-  gsl_multimin_fdfminimizer *s;
-  gsl_vector *x;
-  gsl_multimin_function_fdf min_gsl;
-
-  size_t iter = 0;
-
-  min_gsl.n = parameters.domains.size();
-  min_gsl.f = exec_func_gsl;
-  min_gsl.df = exec_func_gsl_df;
-  min_gsl.fdf = exec_func_gsl_combined;
-  min_gsl.params = this;
-
-  x = gsl_vector_alloc(parameters.domains.size());
-  for (size_t i = 0; i < parameters.domains.size(); i++) {
-    std::uniform_real_distribution<double> dist(parameters.domains[i].first,
-                                                parameters.domains[i].second);
-    gsl_vector_set(x, i, dist(rng));
+  if (store_hits > 0 || store_misses > 0) {
+    std::cout << "Store hits: " << store_hits << "\n";
+    std::cout << "Store misses: " << store_misses << "\n";
   }
-
-  T = gsl_multimin_fdfminimizer_conjugate_fr;
-  s = gsl_multimin_fdfminimizer_alloc(T, parameters.domains.size());
-
-  gsl_multimin_fdfminimizer_set(s, &min_gsl, x, parameters.step_size,
-                                parameters.tol);
-
-  int status;
-  do {
-    iter++;
-    status = gsl_multimin_fdfminimizer_iterate(s);
-
-    if (status)
-      break;
-
-    status = gsl_multimin_test_gradient(s->gradient, parameters.abstol);
-  } while (status == GSL_CONTINUE && iter < parameters.iterations);
-
-  gsl_vector_free(x);
-  double lowest = s->f;
-  std::vector<double> best(s->x->data, s->x->data + s->x->size);
-  gsl_multimin_fdfminimizer_free(s);
-  return {lowest, best, func_calls_};
+  if (reused > 0)
+    std::cout << "Reused evaluations: " << reused << "\n";
+  if (interrupted)
+    std::cout << "Interrupted: this is the best so far\n";
 }
 
 void Optimization::check()
 {
 // Very basic checks currently. This can be improved.
 
-    if (parameters.func == NULL)
+    if (parameters.func == NULL && parameters.func_batch == NULL)
         throw std::invalid_argument("function to optimize must be set");
-    if (parameters.func_name == "external" && parameters.command == "")
+    if ((parameters.func_name == "external" ||
+         parameters.func_name == "external-async" ||
+         parameters.func_name == "external-persistent" ||
+         parameters.func_name == "external-shm") &&
+        parameters.command == "")
         throw std::invalid_argument("command parameter must be set if function is external");
-    if (parameters.dx_name == "external" && parameters.command_dx == "")
+    if ((parameters.dx_name == "external" ||
+         parameters.dx_name == "external-async" ||
+         parameters.dx_name == "external-persistent" ||
+         parameters.dx_name == "external-shm") &&
+        parameters.command_dx == "")
         throw std::invalid_argument("command_dx parameter must be set if dx is external");
+    if (parameters.protocol != "text" && parameters.protocol != "binary")
+        throw std::invalid_argument("protocol must be text or binary");
+    if (parameters.timeout < 0.0)
+        throw std::invalid_argument("timeout must not be negative");
+    if (parameters.speculate != 0.0 && parameters.speculate < 1.0)
+        throw std::invalid_argument("speculate must be 0 or at least 1");
+    // The ring has no way to give up on a slot a model may still answer.
+    if ((parameters.func_name == "external-shm" ||
+         parameters.dx_name == "external-shm") &&
+        (parameters.timeout > 0.0 || parameters.speculate > 0.0 ||
+         !std::isnan(parameters.penalty)))
+        throw std::invalid_argument("timeout, penalty and speculate can't be used with external-shm");
     if (parameters.method == "gradient") {
         if (parameters.dx == NULL)
             throw std::invalid_argument("differential function for gradient descent must be set");
@@ -18,12 +18,19 @@ this program. If not, see https://www.gnu.org/licenses/
 #define FIT_HPP
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <csignal>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
 #include <sstream>
 #include <stdexcept>
@@ -42,11 +49,50 @@ extern "C" {
 namespace Fit {
 typedef std::function<double(const std::vector<double>)> opt_func;
 typedef std::function<std::vector<double>(const std::vector<double>)> opt_func_dx;
+// Zero copy versions of opt_func and opt_func_dx. The point is x[0] to
+// x[n - 1] and the gradient is written to dx[0] to dx[n - 1], so calling
+// them allocates nothing. Optimization evaluates through these; the vector
+// versions are wrapped with the adapters below if they are all that's set.
+typedef std::function<double(const double *x, size_t n)> opt_func_ptr;
+typedef std::function<void(const double *x, size_t n, double *dx)>
+    opt_func_dx_ptr;
+// Evaluates m candidates at once. xs holds them row-major, m rows of n
+// variables, and the function writes the m results to ys. random() and the
+// grid sweeps use it when it is set, so a model can vectorise across
+// candidates and share its setup between them. random() checks error after
+// each batch, so calls can overshoot the first point below it by up to a
+// batch; Parameters::batch = 1 stops at that point.
+typedef std::function<void(const double *xs, size_t m, size_t n, double *ys)>
+    opt_func_batch;
+
+// Adapters between the two: a batch function that calls func once per row,
+// and a single point function that calls func with a batch of one.
+opt_func_batch batch_adapter(const opt_func &func);
+opt_func point_adapter(const opt_func_batch &func);
+
+// Adapters between the vector and the pointer signatures. Going from
+// vector to pointer copies the point on every call, so the pointer versions
+// should be preferred where speed matters.
+opt_func_ptr pointer_adapter(const opt_func &func);
+opt_func_dx_ptr pointer_adapter_dx(const opt_func_dx &dx);
+opt_func vector_adapter(const opt_func_ptr &func);
+opt_func_dx vector_adapter_dx(const opt_func_dx_ptr &dx);
 
 struct Result {
   double lowest;
   std::vector<double> best;
   unsigned calls;
+  unsigned spawns = 0;         // external programs started
+  double spawn_latency = 0.0;  // mean seconds spent starting each one
+  double call_latency = 0.0;   // mean seconds per external call
+  unsigned timeouts = 0;       // external evaluations killed and penalised
+  unsigned speculations = 0;   // duplicate launches of slow evaluations
+  unsigned cache_hits = 0;     // evaluations answered by the cache
+  unsigned cache_misses = 0;   // evaluations the cache passed on to func
+  unsigned store_hits = 0;     // evaluations found in the store
+  unsigned store_misses = 0;   // evaluations run and added to the store
+  unsigned reused = 0;         // evaluations answered by a point nearby
+  bool interrupted = false;    // stopped early by interrupt() or a signal
   void print();
 };
 
@@ -54,21 +100,230 @@ double sphere(const std::vector<double> &v);
 std::vector<double> sphere_dx(const std::vector<double> &v);
 double rastrigin(const std::vector<double> &v);
 double flipflop(const std::vector<double> &v);
+double sphere_ptr(const double *x, size_t n);
+void sphere_dx_ptr(const double *x, size_t n, double *dx);
+double rastrigin_ptr(const double *x, size_t n);
+double flipflop_ptr(const double *x, size_t n);
+
+// Batch versions of the test functions, which evaluate a candidate in each
+// SIMD lane. sphere_dx_batch writes the m gradients row by row to dxs.
+void sphere_batch(const double *xs, size_t m, size_t n, double *ys);
+void sphere_dx_batch(const double *xs, size_t m, size_t n, double *dxs);
+void rastrigin_batch(const double *xs, size_t m, size_t n, double *ys);
+void flipflop_batch(const double *xs, size_t m, size_t n, double *ys);
+
+// The test functions use the widest of the "scalar", "sse2", "avx2" and
+// "avx512" kernels this CPU supports. simd_levels() lists the supported
+// levels, narrowest first, and set_simd_level() picks another one, which
+// is meant for benchmarks and tests rather than for use while optimizing.
+// The kernels differ from each other only by rounding.
+std::string simd_level();
+std::vector<std::string> simd_levels();
+void set_simd_level(const std::string &level);
+
+// Binary frames used by the "binary" protocol for external models: a 32 bit
+// little-endian count n followed by n little-endian IEEE 754 doubles. Model
+// authors writing in C can use fit_protocol.h instead. read_frame() fails on
+// a frame of more than max values without reading or allocating its body,
+// so a corrupt count can't make it allocate gigabytes.
+const size_t frame_max = 1 << 24;
+void write_frame(std::ostream &os, const std::vector<double> &v);
+bool read_frame(std::istream &is, std::vector<double> &v,
+                size_t max = frame_max);
+
+// Time spent starting programs for external and external_dx.
+struct spawn_stats {
+  unsigned spawns = 0;
+  double spawn_seconds = 0.0;
+  double call_seconds = 0.0;
+  unsigned timeouts = 0;
+  unsigned speculations = 0;
+};
+
+// Bounds on how long an external evaluation may take. One that is still
+// running after timeout seconds is killed and scores penalty, or a vector of
+// penalty for a gradient. With speculate set, external-async starts a second
+// copy of an evaluation that has run speculate times longer than the median
+// so far, if it has a free slot, and takes whichever copy answers first.
+// 0 turns either off.
+struct eval_limits {
+  double timeout = 0.0;
+  double penalty = NAN;
+  double speculate = 0.0;
+};
+
+// A program started afresh, without a shell, for every vector. protocol is
+// "text", where the vector is passed as command line arguments, or
+// "binary", where it is sent as a frame on stdin and the reply is expected as
+// a frame on stdout.
+//
+// If batch is not 0, evaluate() sends up to batch vectors to each program on
+// its stdin, one per line or one frame each, and expects one value back per
+// vector. That spreads the program's start up over batch evaluations and lets
+// it vectorise across them.
+class launcher;
 
 struct external {
-  explicit external(std::string &command);
+  explicit external(std::string &command,
+                    const std::string &protocol = "text",
+                    unsigned batch = 0,
+                    const eval_limits &limits = eval_limits());
   double operator()(const std::vector<double> &x_i);
+  std::vector<double> evaluate(const std::vector<std::vector<double>> &xs);
+  spawn_stats stats() const;
 
 private:
-  std::string command_;
+  std::shared_ptr<launcher> launcher_;
+  size_t batch_;
+  double penalty_;
 };
 
 struct external_dx {
-  explicit external_dx(std::string &command);
+  explicit external_dx(std::string &command,
+                       const std::string &protocol = "text",
+                       const eval_limits &limits = eval_limits());
+  std::vector<double> operator()(const std::vector<double> &x_i);
+  spawn_stats stats() const;
+
+private:
+  std::shared_ptr<launcher> launcher_;
+  double penalty_;
+};
+
+// Like external, but the programs are started from one supervisor thread
+// that keeps up to in_flight of them running at once, rather than from the
+// optimizer threads. evaluate() hands over a whole set of vectors at once so
+// that they can all be in flight together, batch per program if batch is not
+// 0.
+class supervisor;
+
+struct external_async {
+  external_async(std::string &command, unsigned in_flight,
+                 const std::string &protocol = "text", unsigned batch = 0,
+                 const eval_limits &limits = eval_limits());
+  double operator()(const std::vector<double> &x_i);
+  std::vector<double> evaluate(const std::vector<std::vector<double>> &xs);
+  spawn_stats stats() const;
+
+private:
+  std::shared_ptr<supervisor> supervisor_;
+  size_t batch_;
+  double penalty_;
+};
+
+struct external_dx_async {
+  external_dx_async(std::string &command, unsigned in_flight,
+                    const std::string &protocol = "text",
+                    const eval_limits &limits = eval_limits());
+  std::vector<double> operator()(const std::vector<double> &x_i);
+  spawn_stats stats() const;
+
+private:
+  std::shared_ptr<supervisor> supervisor_;
+  double penalty_;
+};
+
+// A model that is started once and then fed one vector per line on its
+// standard input. It must reply with one line on its standard output per
+// vector received, or a frame per frame if protocol is "binary". Up to
+// workers copies of the model are run so that optimizer threads don't queue
+// behind each other.
+class worker_pool;
+
+struct external_persistent {
+  explicit external_persistent(std::string &command, unsigned workers = 1,
+                               const std::string &protocol = "text",
+                               const eval_limits &limits = eval_limits());
+  double operator()(const std::vector<double> &x_i);
+  spawn_stats stats() const;
+
+private:
+  std::shared_ptr<worker_pool> pool_;
+  double penalty_;
+};
+
+struct external_dx_persistent {
+  explicit external_dx_persistent(std::string &command, unsigned workers = 1,
+                                  const std::string &protocol = "text",
+                                  const eval_limits &limits = eval_limits());
   std::vector<double> operator()(const std::vector<double> &x_i);
+  spawn_stats stats() const;
 
 private:
-  std::string command_;
+  std::shared_ptr<worker_pool> pool_;
+  double penalty_;
+};
+
+// A model that is started once, as workers processes, and exchanges vectors
+// and replies with fit through a ring buffer in shared memory rather than
+// pipes. The model must use fit_shm.h. variables is the length of the
+// longest vector or reply that will be exchanged.
+class shm_ring;
+
+struct external_shm {
+  external_shm(std::string &command, size_t variables, unsigned workers = 1);
+  double operator()(const std::vector<double> &x_i);
+  // Posts all of xs to the ring before waking the models.
+  std::vector<double> evaluate(const std::vector<std::vector<double>> &xs);
+
+private:
+  std::shared_ptr<shm_ring> ring_;
+};
+
+struct external_dx_shm {
+  external_dx_shm(std::string &command, size_t variables,
+                  unsigned workers = 1);
+  std::vector<double> operator()(const std::vector<double> &x_i);
+
+private:
+  std::shared_ptr<shm_ring> ring_;
+};
+
+// An objective function or gradient loaded from a shared library. spec has
+// the form plugin:/path/libmodel.so:symbol and fit_plugin.h describes what
+// the library must export. The function runs on the optimizer threads
+// without any process or text overhead.
+class plugin_library;
+
+struct plugin {
+  plugin(const std::string &spec, size_t variables);
+  double operator()(const std::vector<double> &x_i);
+  double operator()(const double *x, size_t n);
+
+private:
+  std::shared_ptr<plugin_library> lib_;
+};
+
+struct plugin_dx {
+  plugin_dx(const std::string &spec, size_t variables);
+  std::vector<double> operator()(const std::vector<double> &x_i);
+  void operator()(const double *x, size_t n, double *dx);
+
+private:
+  std::shared_ptr<plugin_library> lib_;
+};
+
+class pool_state;
+
+// Threads that run the optimization methods' parallel work. They are
+// started once and kept for the life of the pool, so that passes and
+// generations don't pay for creating threads. run() hands out task(0) to
+// task(count - 1) to the pool and to the calling thread, and returns when
+// all of them have finished, rethrowing the first exception any of them
+// threw. Tasks may call run() themselves, and idle threads steal from
+// those nested runs too, so uneven tasks don't leave threads waiting while
+// there is work left anywhere in the pool.
+class thread_pool {
+public:
+  // threads counts the thread that calls run(), so threads - 1 are started.
+  explicit thread_pool(unsigned threads);
+  unsigned size() const;
+  // Threads of the pool that aren't running a task at the moment.
+  unsigned idle() const;
+  void run(size_t count, const std::function<void(size_t)> &task);
+
+private:
+  std::shared_ptr<pool_state> state_;
 };
 
 struct Parameters {
@@ -77,8 +332,12 @@ struct Parameters {
   std::string dx_name;
   opt_func func;
   opt_func_dx dx;
+  opt_func_ptr func_ptr; // optional, used instead of func if set
+  opt_func_dx_ptr dx_ptr; // optional, used instead of dx if set
+  opt_func_batch func_batch; // optional, see opt_func_batch
   std::string command;
   std::string command_dx;
+  std::string protocol = "text";
   unsigned variables = 1;
   std::vector<double> lo = {-100.0};
   std::vector<double> hi = {100.0};
@@ -89,10 +348,31 @@ struct Parameters {
   double abstol = 1e-3;
   bool verbose = false;
   unsigned threads = std::thread::hardware_concurrency();
+  // optional, a pool to share between optimizations instead of each one
+  // starting threads of its own
+  std::shared_ptr<thread_pool> pool;
+  unsigned workers = 0; // 0 means one model process per thread
+  unsigned in_flight = 0; // 0 means as many external-async programs as threads
+  unsigned external_batch = 0; // vectors per external program, 0 for argv
+  unsigned batch = 0; // candidates per func_batch call, 0 for automatic
+  double timeout = 0.0; // seconds per external evaluation, 0 for no limit
+  double penalty = NAN; // value of an evaluation that timed out
+  double speculate = 0.0; // see eval_limits, 0 for no duplicate launches
   unsigned iterations = 1000;
   std::vector<unsigned> divisions = {5};
   unsigned generations = 3;
   unsigned passes = 1;
+  std::optional<uint64_t> seed; // unset picks one at random, when optimizing
+                                // starts
+  unsigned cache = 0; // megabytes of evaluations to remember, 0 for none
+  double cache_quantum = 0.0; // see eval_cache, 0 to match points exactly
+  std::string store; // file of evaluations kept between runs, "" for none
+  std::string store_tag; // version of the model, so old values aren't used
+  double reuse_radius = 0.0; // see reuse_index, 0 to evaluate every point
+  std::string checkpoint; // file to save progress in, "" for none
+  double checkpoint_interval = 60.0; // seconds between checkpoints
+  std::string resume; // checkpoint to carry on from, "" to start afresh
+  std::string log; // file to record every evaluation in, "" for none
   bool check = true;
   void print();
 };
@@ -100,9 +380,217 @@ struct Parameters {
 void make_divisions(Parameters &parameters);
 void make_domains(Parameters &parameters);
 
-class Optimization {
+// The random number generator for the calling thread, seeded from
+// std::random_device. The optimization methods don't use it; they draw from
+// a philox keyed by Parameters::seed.
+std::default_random_engine &random_engine();
+
+// Philox 4x32-10, the counter-based generator from Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3". Its output is a function of the key
+// and a 128 bit counter only, so the numbers for a counter are the same
+// whichever thread asks for them and in whatever order.
+class philox {
 public:
-  explicit Optimization(const Parameters &p = Parameters());
+  typedef std::array<uint32_t, 4> counter;
+  explicit philox(uint64_t key = 0);
+  counter operator()(counter c) const;
+  // n uniform doubles in [0, 1) for the draw (index, pass, generation),
+  // two from each of the counters (k, index, pass, generation).
+  void uniform(uint32_t index, uint32_t pass, uint32_t generation, double *u,
+               size_t n) const;
+
+private:
+  uint32_t key_[2];
+};
+
+// The best point found so far by any of the threads of a method. value()
+// is a single atomic load, cheap enough to check after every evaluation.
+// offer() replaces the point if y is lower, under a sequence lock that
+// only writers wait on, which is rare as improvements get rarer as a
+// search goes on; get() retries instead of waiting if it races with one.
+class incumbent {
+public:
+  explicit incumbent(size_t n,
+                     double initial = std::numeric_limits<float>::max());
+  double value() const { return value_.load(std::memory_order_acquire); }
+  bool offer(double y, const double *x);
+  std::pair<double, std::vector<double>> get() const;
+
+private:
+  std::atomic<double> value_;
+  std::atomic<unsigned> sequence_{0};
+  std::unique_ptr<std::atomic<double>[]> x_;
+  size_t n_;
+};
+
+class cache_state;
+
+// Remembers objective values, so that points evaluated again, which grid
+// does a lot as the generations close in on the best point, cost a lookup.
+// Points are keyed on the bit patterns of their variables, after rounding
+// each to a multiple of quantum if that is not 0, in which case every point
+// in a cell gets the value of the first one evaluated. The entries are
+// spread over shards with a lock each, and the least recently used are
+// evicted once they would take more than bytes. A thread that asks for a
+// point another thread is evaluating waits for that value rather than
+// evaluating the point again. NaN and penalty, the value of an evaluation
+// that timed out, are handed to the threads waiting for them but not kept,
+// so a passing failure is tried again the next time.
+class eval_cache {
+public:
+  eval_cache(size_t bytes, size_t n, double quantum = 0.0,
+             double penalty = NAN);
+  // The value of x, calling func only if it is not known already.
+  double evaluate(const double *x, size_t n, const opt_func_ptr &func);
+  // For callers that evaluate in batches: find() sets y if x is cached,
+  // waiting if it is being evaluated, and insert() adds a new value.
+  bool find(const double *x, size_t n, double &y);
+  void insert(const double *x, size_t n, double y);
+  unsigned hits() const;
+  unsigned misses() const;
+
+private:
+  std::shared_ptr<cache_state> state_;
+};
+
+class store_file;
+
+// Objective values kept in a file, so that runs of fit, one after another
+// or at the same time on the same machine, never evaluate the same point of
+// the same model twice. identity names the model, and only records with the
+// same identity are used; points are matched exactly. The file is only
+// ever appended to, under a lock, and read through a shared mapping.
+//
+// Before evaluating a point a process appends a claim to it, and others
+// that want the point wait for the value instead of evaluating it too,
+// unless the process that claimed it has gone. An evaluation that fails, by
+// throwing, returning NaN or being scored as penalty after a timeout, gives
+// up its claim rather than being kept, so later runs try it again.
+class eval_store {
+public:
+  eval_store(const std::string &path, const std::string &identity,
+             double penalty = NAN);
+  double evaluate(const double *x, size_t n, const opt_func_ptr &func);
+  // The m rows of xs, as with opt_func_batch, passing func only the rows
+  // nobody has evaluated.
+  void evaluate(const double *xs, size_t m, size_t n, double *ys,
+                const opt_func_batch &func);
+  unsigned hits() const;
+  unsigned misses() const;
+
+private:
+  std::shared_ptr<store_file> file_;
+  double penalty_;
+};
+
+// Installs handlers for SIGINT and SIGTERM that interrupt optimizing: the
+// methods stop as soon as they can, save a checkpoint if they have a file
+// for one and return the best point so far, with interrupted set in the
+// Result. A second signal kills the process as usual.
+void catch_signals();
+// The signal that interrupted optimizing, or 0. interrupt() also lets
+// another thread stop an optimization, and interrupt(0) clears it again.
+int interrupted();
+void interrupt(int signal = SIGINT);
+
+// What a method needs to carry on from where it was. position is the grid
+// generation to start, the next random iteration or the number of simplex
+// or gradient iterations done; domains are grid's for that generation.
+// invocation is which optimize() call of its object it was taken in. The
+// function and the method's parameters are kept so that a resumed run can
+// refuse to carry on with different ones. save() writes to a temporary
+// file, renames it over path and syncs the directory, so the file always
+// holds a whole checkpoint, even if fit is killed while saving.
+struct checkpoint {
+  std::string method;
+  std::string function; // func_name, then the command if there is one
+  unsigned variables = 0;
+  std::vector<unsigned> divisions;
+  unsigned passes = 0;
+  unsigned iterations = 0;
+  uint64_t seed = 0;
+  unsigned invocation = 0;
+  unsigned position = 0;
+  unsigned calls = 0;
+  double lowest = std::numeric_limits<float>::max();
+  std::vector<double> best;
+  std::vector<std::pair<double, double>> domains;
+  void save(const std::string &path) const;
+  static checkpoint load(const std::string &path);
+};
+
+class kd_tree;
+
+// The points evaluated so far, in a kd-tree, so that a point within radius
+// of one of them in every variable can have its value instead of being
+// evaluated. Variables are scaled by the widths of domains, so radius is a
+// fraction of each domain. Of the points within the radius the nearest one
+// is used, and find() copies it to at, if given, so that the caller can
+// keep the value with the point it belongs to. evaluated() only finds x
+// itself, and doesn't count as reuse.
+class reuse_index {
+public:
+  reuse_index(const std::vector<std::pair<double, double>> &domains,
+              double radius);
+  bool find(const double *x, size_t n, double &y, double *at = nullptr) const;
+  bool evaluated(const double *x, size_t n, double &y) const;
+  void insert(const double *x, size_t n, double y);
+  unsigned hits() const;
+
+private:
+  std::shared_ptr<kd_tree> tree_;
+};
+
+class log_writer;
+
+// Records every evaluation of the objective in a file: the point, its value,
+// when the evaluation started, how long it took and which thread ran it.
+// add() copies the row into a ring of the calling thread's own, without
+// locks or system calls other than reading the clock, and a background
+// thread moves the rows from the rings to the file every few milliseconds.
+// The file is a header followed by blocks of rows stored column by column,
+// each block written whole, so it can be read while fit is still running.
+class eval_log {
+public:
+  typedef std::chrono::steady_clock clock;
+  eval_log(const std::string &path, size_t n);
+  void add(const double *x, double y, clock::time_point start,
+           clock::time_point end);
+
+private:
+  std::shared_ptr<log_writer> writer_;
+};
+
+// A row of an evaluation log. Threads are numbered in the order they first
+// evaluated something.
+struct log_record {
+  int64_t time; // nanoseconds since the epoch when the evaluation started
+  int64_t wall; // nanoseconds it took
+  unsigned thread;
+  double y;
+  std::vector<double> x;
+};
+
+// The rows of an evaluation log, up to a block that is still being written
+// or was left unfinished.
+std::vector<log_record> read_log(const std::string &path);
+
+// The optimization methods, templated on the objective F, callable as
+// double(const double *x, size_t n), and the gradient DX, callable as
+// void(const double *x, size_t n, double *dx). Given the types of plain
+// functions or lambdas, the compiler can inline the objective into the
+// random, grid and simplex loops:
+//
+//   auto f = [](const double *x, size_t n) { return x[0] * x[0]; };
+//   Fit::basic_optimization<decltype(f)> o(parameters, f);
+//   auto result = o.optimize();
+//
+// func_batch in parameters is still used for random() and the grid sweeps
+// if it is set. basic_optimization does no checking of parameters and knows
+// nothing about external models; Optimization adds both.
+template <typename F, typename DX = opt_func_dx_ptr> class basic_optimization {
+public:
+  basic_optimization(const Parameters &p, F func, DX dx = DX());
   Result optimize();
   Result random();
   Result grid();
@@ -110,20 +598,794 @@ public:
   Result gradient_descent();
   Parameters parameters;
 
-private:
-  void
-  single_pass(unsigned pass_no, unsigned thread_no,
-              const std::vector<double> &step_size,
-              std::vector<std::pair<double, std::vector<double>>> &results);
-  double exec_func(const std::vector<double> &x);
-  void check();
+protected:
+  void single_pass(unsigned generation, unsigned pass_no,
+                   const std::vector<double> &step_size, incumbent &best_ever,
+                   std::atomic<bool> &stop);
+  void draw(uint32_t index, uint32_t pass, uint32_t generation, double *x);
+  double exec_func(const double *x, size_t n, double *at = nullptr);
+  double cached_func(const double *x, size_t n);
+  void own_value(const std::vector<double> &x, double &y);
+  double stored_func(const double *x, size_t n);
+  void stored_func_batch(const double *xs, size_t m, size_t n, double *ys);
+  double logged_func(const double *x, size_t n);
+  void logged_func_batch(const double *xs, size_t m, size_t n, double *ys);
+  size_t exec_func_many(double *xs, size_t m, size_t n, double *ys,
+                        std::atomic<bool> *stop = nullptr);
+  unsigned in_flight() const;
+  unsigned batch_size() const;
+  checkpoint settings() const;
+  void checkpoint_if_due(const std::function<checkpoint()> &state,
+                         bool now = false);
+  thread_pool &pool();
   static double exec_func_gsl(const gsl_vector *v, void *params);
   static void exec_func_gsl_df(const gsl_vector *v, void *params,
                                gsl_vector *df);
   static void exec_func_gsl_combined(const gsl_vector *x, void *params,
                                      double *f, gsl_vector *df);
+  F func_;
+  DX dx_;
   std::vector<std::pair<double, double>> original_domains_;
+  std::shared_ptr<thread_pool> pool_;
+  philox rng_;
+  std::shared_ptr<eval_cache> cache_; // if parameters.cache is set
+  std::shared_ptr<eval_store> store_; // if parameters.store is set
+  std::shared_ptr<reuse_index> reuse_; // if parameters.reuse_radius is set
+  std::shared_ptr<eval_log> log_; // if parameters.log is set
+  // Calls are counted locally and added here once per batch, pass or
+  // method, so that evaluations don't contend on it.
   std::atomic_uint func_calls_;
+  unsigned gsl_calls_ = 0;
+  // optimize() calls started, and which of them is running. draw() mixes
+  // the running one into its counters, so each call draws new candidates.
+  uint32_t invocations_ = 0;
+  uint32_t invocation_ = 0;
+  // From parameters.resume, for the first method run to carry on from.
+  checkpoint resume_;
+  bool resuming_ = false;
+  std::mutex checkpoint_mutex_;
+  std::chrono::steady_clock::time_point checkpointed_;
 };
+
+// The engine over type-erased functions, which is what the command line
+// uses. The constructor turns the function names in the parameters into
+// functions, starting external models as needed, and optimize() checks the
+// parameters first and reports on the external programs afterwards.
+class Optimization
+    : public basic_optimization<opt_func_ptr, opt_func_dx_ptr> {
+public:
+  explicit Optimization(const Parameters &p = Parameters());
+  Result optimize();
+
+private:
+  unsigned workers() const;
+  eval_limits limits() const;
+  void add_spawn_stats(Result &result) const;
+  void check();
+};
+
+template <typename F, typename DX>
+basic_optimization<F, DX>::basic_optimization(const Parameters &p, F func,
+                                              DX dx)
+    : parameters(p), func_(func), dx_(dx), func_calls_(0),
+      checkpointed_(std::chrono::steady_clock::now()) {
+  make_divisions(parameters);
+  make_domains(parameters);
+  original_domains_ = parameters.domains;
+  if (parameters.resume != "") {
+    resume_ = checkpoint::load(parameters.resume);
+    checkpoint expected = settings();
+    if (resume_.method != expected.method)
+      throw std::invalid_argument(parameters.resume + " is a checkpoint of " +
+                                  resume_.method + ", not " +
+                                  parameters.method);
+    size_t n = expected.variables;
+    if (resume_.variables != n ||
+        (!resume_.best.empty() && resume_.best.size() != n) ||
+        (parameters.method == "grid" && resume_.domains.size() != n))
+      throw std::invalid_argument(parameters.resume + " is not a checkpoint "
+                                  "for " + std::to_string(n) + " variables");
+    if (resume_.function != expected.function)
+      throw std::invalid_argument(parameters.resume + " is a checkpoint of " +
+                                  "another function");
+    if (resume_.divisions != expected.divisions ||
+        resume_.passes != expected.passes ||
+        resume_.iterations != expected.iterations)
+      throw std::invalid_argument(parameters.resume + " was taken with other "
+                                  "divisions, passes or iterations");
+    resuming_ = true;
+    parameters.seed = resume_.seed;
+    if (parameters.checkpoint == "")
+      parameters.checkpoint = parameters.resume;
+  }
+  if (!parameters.seed) {
+    std::random_device rd;
+    parameters.seed = (uint64_t)rd() << 32 | rd();
+  }
+  rng_ = philox(*parameters.seed);
+  if (parameters.cache > 0) {
+    cache_ = std::make_shared<eval_cache>((size_t)parameters.cache << 20,
+                                          parameters.domains.size(),
+                                          parameters.cache_quantum,
+                                          parameters.penalty);
+  }
+  if (parameters.store != "") {
+    std::string identity = parameters.func_name + '\0' + parameters.command +
+                           '\0' + parameters.store_tag;
+    store_ = std::make_shared<eval_store>(parameters.store, identity,
+                                          parameters.penalty);
+  }
+  if (parameters.reuse_radius > 0.0) {
+    reuse_ = std::make_shared<reuse_index>(parameters.domains,
+                                           parameters.reuse_radius);
+  }
+  if (parameters.log != "") {
+    log_ = std::make_shared<eval_log>(parameters.log,
+                                      parameters.domains.size());
+  }
+}
+
+template <typename F, typename DX>
+Result basic_optimization<F, DX>::optimize() {
+  Result result;
+  // A resumed run draws what the call it carries on from would have.
+  invocation_ = resuming_ ? resume_.invocation : invocations_;
+  invocations_ = invocation_ + 1;
+  if (parameters.method == "random") {
+    result = random();
+  } else if (parameters.method == "grid") {
+    result = grid();
+  } else if (parameters.method == "nms") {
+    result = nelder_mead_simplex();
+  } else if (parameters.method == "gradient") {
+    result = gradient_descent();
+  } else {
+    std::string msg = "unknown optimization method " + parameters.method;
+    throw std::invalid_argument(msg);
+  }
+  if (cache_) {
+    result.cache_hits = cache_->hits();
+    result.cache_misses = cache_->misses();
+  }
+  if (store_) {
+    result.store_hits = store_->hits();
+    result.store_misses = store_->misses();
+  }
+  if (reuse_)
+    result.reused = reuse_->hits();
+  result.interrupted = interrupted() != 0;
+  return result;
+}
+
+// The checkpoint fields that must match for a run to be resumed.
+template <typename F, typename DX>
+checkpoint basic_optimization<F, DX>::settings() const {
+  checkpoint c;
+  c.method = parameters.method;
+  c.function = parameters.func_name;
+  if (parameters.command != "")
+    c.function += " " + parameters.command;
+  c.variables = parameters.domains.size();
+  c.divisions = parameters.divisions;
+  c.passes = parameters.passes;
+  c.iterations = parameters.iterations;
+  return c;
+}
+
+// Saves the checkpoint state() returns to parameters.checkpoint, if it is
+// set, when checkpoint_interval seconds have passed since the last one, or
+// whenever now is set. Threads may call this together; state() is only
+// called by one at a time.
+template <typename F, typename DX>
+void basic_optimization<F, DX>::checkpoint_if_due(
+    const std::function<checkpoint()> &state, bool now) {
+  if (parameters.checkpoint == "")
+    return;
+  std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+  std::chrono::duration<double> since =
+      std::chrono::steady_clock::now() - checkpointed_;
+  if (!now && since.count() < parameters.checkpoint_interval)
+    return;
+  checkpoint c = state();
+  checkpoint s = settings();
+  c.method = s.method;
+  c.function = s.function;
+  c.variables = s.variables;
+  c.divisions = s.divisions;
+  c.passes = s.passes;
+  c.iterations = s.iterations;
+  c.seed = *parameters.seed;
+  c.invocation = invocation_;
+  c.save(parameters.checkpoint);
+  checkpointed_ = std::chrono::steady_clock::now();
+}
+
+// The objective, or the value of a point within the reuse radius, in which
+// case that point is copied to at if it is given.
+template <typename F, typename DX>
+double basic_optimization<F, DX>::exec_func(const double *x, size_t n,
+                                            double *at) {
+  double y;
+  if (reuse_ && reuse_->find(x, n, y, at))
+    return y;
+  y = cached_func(x, n);
+  if (reuse_)
+    reuse_->insert(x, n, y);
+  return y;
+}
+
+// The objective, looked up first in the cache and then in the store.
+template <typename F, typename DX>
+double basic_optimization<F, DX>::cached_func(const double *x, size_t n) {
+  if (!cache_)
+    return stored_func(x, n);
+  return cache_->evaluate(
+      x, n, [this](const double *x, size_t n) { return stored_func(x, n); });
+}
+
+// GSL only knows the values it was given, and with a reuse radius some of
+// them are a neighbour's. The point a method returns gets its own value,
+// evaluated now if it never was.
+template <typename F, typename DX>
+void basic_optimization<F, DX>::own_value(const std::vector<double> &x,
+                                          double &y) {
+  if (!reuse_ || reuse_->evaluated(x.data(), x.size(), y))
+    return;
+  y = cached_func(x.data(), x.size());
+  reuse_->insert(x.data(), x.size(), y);
+  func_calls_++;
+}
+
+template <typename F, typename DX>
+double basic_optimization<F, DX>::stored_func(const double *x, size_t n) {
+  if (!store_)
+    return logged_func(x, n);
+  return store_->evaluate(
+      x, n, [this](const double *x, size_t n) { return logged_func(x, n); });
+}
+
+template <typename F, typename DX>
+void basic_optimization<F, DX>::stored_func_batch(const double *xs, size_t m,
+                                                  size_t n, double *ys) {
+  if (!store_) {
+    logged_func_batch(xs, m, n, ys);
+  } else if (!log_) {
+    store_->evaluate(xs, m, n, ys, parameters.func_batch);
+  } else {
+    store_->evaluate(xs, m, n, ys,
+                     [this](const double *xs, size_t m, size_t n, double *ys) {
+                       logged_func_batch(xs, m, n, ys);
+                     });
+  }
+}
+
+// The objective itself, timed and added to the log if there is one. Only
+// these calls are logged, not the values found in the cache or the store.
+template <typename F, typename DX>
+double basic_optimization<F, DX>::logged_func(const double *x, size_t n) {
+  if (!log_)
+    return func_(x, n);
+  auto start = eval_log::clock::now();
+  double y = func_(x, n);
+  log_->add(x, y, start, eval_log::clock::now());
+  return y;
+}
+
+// The rows of a batch share the start and the wall time of the call.
+template <typename F, typename DX>
+void basic_optimization<F, DX>::logged_func_batch(const double *xs, size_t m,
+                                                  size_t n, double *ys) {
+  if (!log_) {
+    parameters.func_batch(xs, m, n, ys);
+    return;
+  }
+  auto start = eval_log::clock::now();
+  parameters.func_batch(xs, m, n, ys);
+  auto end = eval_log::clock::now();
+  for (size_t i = 0; i < m; i++)
+    log_->add(xs + i * n, ys[i], start, end);
+}
+
+// Number of programs external-async keeps running at once.
+template <typename F, typename DX>
+unsigned basic_optimization<F, DX>::in_flight() const {
+  return parameters.in_flight > 0 ? parameters.in_flight : parameters.threads;
+}
+
+// The pool from the parameters if there is one, otherwise one of our own
+// with parameters.threads threads. It is started on first use and kept for
+// later calls of optimize(), unless the number of threads has changed.
+template <typename F, typename DX>
+thread_pool &basic_optimization<F, DX>::pool() {
+  if (parameters.pool)
+    return *parameters.pool;
+  unsigned threads = std::max(parameters.threads, 1u);
+  if (!pool_ || pool_->size() != threads)
+    pool_ = std::make_shared<thread_pool>(threads);
+  return *pool_;
+}
+
+// A point drawn uniformly from the domains. Every candidate a method draws
+// has its own (index, pass, generation), so the same seed gives the same
+// candidates however the work is split between threads. The optimize() call
+// goes in the top half of the generation word, which grid's generations
+// never reach.
+template <typename F, typename DX>
+void basic_optimization<F, DX>::draw(uint32_t index, uint32_t pass,
+                                     uint32_t generation, double *x) {
+  size_t n = parameters.domains.size();
+  rng_.uniform(index, pass, generation ^ invocation_ << 16, x, n);
+  for (size_t j = 0; j < n; j++) {
+    auto &d = parameters.domains[j];
+    x[j] = std::min(d.first + x[j] * (d.second - d.first), d.second);
+  }
+}
+
+// How many random candidates to draw and evaluate together: the batch
+// parameter if it is set, otherwise enough to fill external-async's
+// programs, or one external batch, or a block of 64 for other batch
+// functions. Without a batch function candidates are drawn one at a time.
+template <typename F, typename DX>
+unsigned basic_optimization<F, DX>::batch_size() const {
+  if (!parameters.func_batch)
+    return 1;
+  if (parameters.batch > 0)
+    return parameters.batch;
+  unsigned per_program = std::max(parameters.external_batch, 1u);
+  if (parameters.func_name == "external-async")
+    return in_flight() * per_program;
+  if (parameters.func_name == "external")
+    return per_program;
+  return 64;
+}
+
+// Evaluates m independent vectors of n variables, stored row-major in xs,
+// into ys: with one call to the batch function if there is one, otherwise
+// one by one. The one by one evaluations are spread over the pool if any
+// of its threads are idle: always when grid has fewer passes than threads,
+// and towards the end of a generation when only the slow passes are left.
+//
+// With stop, a point within the error sets it, and once it is set, by us
+// or by another thread, the points not yet started are skipped and left as
+// NAN. A row that takes the value of a point within the reuse radius is
+// replaced by that point, so rows and values always belong together.
+// Returns the number of points evaluated.
+template <typename F, typename DX>
+size_t basic_optimization<F, DX>::exec_func_many(double *xs, size_t m,
+                                                 size_t n, double *ys,
+                                                 std::atomic<bool> *stop) {
+  if (!parameters.func_batch) {
+    std::atomic<size_t> evaluated(0);
+    auto evaluate = [this, xs, n, ys, stop, &evaluated](size_t i) {
+      if (stop && *stop) {
+        ys[i] = NAN;
+        return;
+      }
+      ys[i] = exec_func(xs + i * n, n, xs + i * n);
+      evaluated++;
+      if (stop && ys[i] <= parameters.error)
+        *stop = true;
+    };
+    if (m > 1 && pool().idle() > 0) {
+      pool().run(m, evaluate);
+    } else {
+      for (size_t i = 0; i < m; i++)
+        evaluate(i);
+    }
+    return evaluated;
+  }
+  std::fill(ys, ys + m, NAN);
+  if (stop && *stop)
+    return 0;
+  if (cache_ || reuse_) {
+    // Only the rows with no point nearby and not in the cache go to the
+    // batch function.
+    std::vector<size_t> rows;
+    std::vector<double> missing;
+    for (size_t i = 0; i < m; i++) {
+      double *x = xs + i * n;
+      if (!(reuse_ && reuse_->find(x, n, ys[i], x)) &&
+          !(cache_ && cache_->find(x, n, ys[i]))) {
+        rows.push_back(i);
+        missing.insert(missing.end(), xs + i * n, xs + (i + 1) * n);
+      }
+    }
+    std::vector<double> values(rows.size(), NAN);
+    if (!rows.empty())
+      stored_func_batch(missing.data(), rows.size(), n, values.data());
+    for (size_t k = 0; k < rows.size(); k++) {
+      ys[rows[k]] = values[k];
+      if (cache_)
+        cache_->insert(missing.data() + k * n, n, values[k]);
+      if (reuse_)
+        reuse_->insert(missing.data() + k * n, n, values[k]);
+    }
+  } else {
+    stored_func_batch(xs, m, n, ys);
+  }
+  if (stop && std::any_of(ys, ys + m, [this](double y) {
+        return y <= parameters.error;
+      }))
+    *stop = true;
+  return m;
+}
+
+// The iterations are shared out between the pool's threads in chunks that
+// they claim as they go, so threads with cheaper evaluations do more of
+// them: a batch at a time with a batch function, otherwise enough that the
+// claims don't contend without leaving threads short of work at the end.
+// Candidate i is draw i, whichever thread evaluates it, and all the threads
+// stop as soon as any finds a point within the error. A checkpoint records
+// the first candidate of the earliest chunk not finished yet, so a resumed
+// run evaluates at most a few chunks again.
+template <typename F, typename DX>
+Result basic_optimization<F, DX>::random() {
+  size_t n = parameters.domains.size();
+  unsigned batch = batch_size();
+  unsigned tasks = pool().size();
+  size_t chunk = batch;
+  if (!parameters.func_batch)
+    chunk = std::min(std::max(parameters.iterations / (tasks * 8), 1u), 256u);
+  incumbent best(n);
+  size_t first = 0;
+  if (resuming_) {
+    first = resume_.position;
+    func_calls_ = resume_.calls;
+    if (!resume_.best.empty())
+      best.offer(resume_.lowest, resume_.best.data());
+    resuming_ = false;
+  }
+  // func_calls_ only takes the threads' counts at the end, and counts the
+  // calls of earlier optimize()s, so the checkpoint counts from here.
+  unsigned calls_before = func_calls_;
+  std::atomic<size_t> next(first);
+  std::atomic<bool> stop(false);
+  // The lowest candidate each thread may still be working on.
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::unique_ptr<std::atomic<size_t>[]> working(
+      new std::atomic<size_t>[tasks]);
+  for (unsigned t = 0; t < tasks; t++)
+    working[t] = none;
+  auto state = [&] {
+    checkpoint c;
+    size_t done = next;
+    for (unsigned t = 0; t < tasks; t++)
+      done = std::min<size_t>(done, working[t]);
+    c.position = std::min<size_t>(done, parameters.iterations);
+    c.calls = calls_before + (c.position - first);
+    std::tie(c.lowest, c.best) = best.get();
+    return c;
+  };
+  pool().run(tasks, [&](size_t t) {
+    // Candidates are drawn into one row-major block that every round
+    // reuses.
+    std::vector<double> vs(batch * n);
+    std::vector<double> ds(batch);
+    unsigned calls = 0;
+    while (!stop && !interrupted()) {
+      // Covers the chunk before it is claimed, so a checkpoint taken in
+      // between can't skip it.
+      working[t] = next.load();
+      size_t i = next.fetch_add(chunk);
+      if (i >= parameters.iterations)
+        break;
+      working[t] = i;
+      size_t end = std::min<size_t>(i + chunk, parameters.iterations);
+      for (; i < end && !stop && !interrupted(); i += batch) {
+        size_t m = std::min<size_t>(batch, end - i);
+        for (size_t k = 0; k < m; k++)
+          draw(i + k, 0, 0, vs.data() + k * n);
+        exec_func_many(vs.data(), m, n, ds.data());
+        calls += m;
+        for (size_t k = 0; k < m; k++) {
+          if (ds[k] < best.value()) {
+            best.offer(ds[k], vs.data() + k * n);
+            if (ds[k] <= parameters.error)
+              stop = true;
+          }
+        }
+      }
+      if (i >= end) {
+        working[t] = none;
+        checkpoint_if_due(state);
+      }
+    }
+    func_calls_ += calls;
+  });
+  if (interrupted())
+    checkpoint_if_due(state, true);
+  auto found = best.get();
+  // Nothing was evaluated, or nothing came back as a number.
+  if (!(found.first < std::numeric_limits<float>::max()))
+    found.second.clear();
+  return {found.first, found.second, func_calls_};
+}
+
+// One pass of a generation: a sweep along each coordinate in turn, from
+// the best point of the sweep before, with the coordinates after the one
+// swept drawn at random: draw i of the pass for the sweep along coordinate
+// i. The best point of every sweep is offered to best_ever, and the pass
+// gives up as soon as stop is set.
+template <typename F, typename DX>
+void basic_optimization<F, DX>::single_pass(
+    unsigned generation, unsigned pass_no,
+    const std::vector<double> &step_size, incumbent &best_ever,
+    std::atomic<bool> &stop) {
+  std::vector<double> begin(parameters.domains.size());
+
+  for (size_t i = 0; i < parameters.domains.size(); i++) {
+    begin[i] = std::min(parameters.domains[i].first +
+                            (double)pass_no / parameters.passes * step_size[i],
+                        original_domains_[i].second);
+  }
+  size_t n = parameters.domains.size();
+  std::vector<double> best(n);
+  // Room for the longest sweep, reused for every coordinate.
+  unsigned longest = *std::max_element(parameters.divisions.begin(),
+                                       parameters.divisions.end());
+  std::vector<double> sweep(longest * n);
+  std::vector<double> fs(longest);
+  std::vector<double> v(n), r(n);
+  unsigned calls = 0;
+  for (size_t i = 0; i < parameters.domains.size() && !stop && !interrupted();
+       i++) {
+    for (size_t j = 0; j < i; j++) {
+      v[j] = best[j];
+    }
+    v[i] = begin[i];
+    draw(i, pass_no, generation, r.data());
+    std::copy(r.begin() + i + 1, r.end(), v.begin() + i + 1);
+    // The points along coordinate i don't depend on each other, so they are
+    // evaluated as one set.
+    size_t m = parameters.divisions[i];
+    for (size_t j = 0; j < m; j++) {
+      std::copy(v.begin(), v.end(), sweep.begin() + j * n);
+      v[i] = std::min(v[i] + step_size[i], original_domains_[i].second);
+    }
+    calls += exec_func_many(sweep.data(), m, n, fs.data(), &stop);
+    double lowest = std::numeric_limits<float>::max();
+    for (size_t j = 0; j < m; j++) {
+      if (fs[j] < lowest) {
+        lowest = fs[j];
+        std::copy(sweep.begin() + j * n, sweep.begin() + (j + 1) * n,
+                  best.begin());
+      }
+    }
+    best_ever.offer(lowest, best.data());
+  }
+  func_calls_ += calls;
+}
+
+// Each generation narrows the domains to a step either side of the best
+// point so far. The passes share that point through an incumbent, and all
+// of them, and the generations after, stop as soon as any pass finds a
+// point within the error. Checkpoints are taken between generations, or in
+// the middle of one when interrupted, in which case a resumed run does that
+// generation again from the start.
+template <typename F, typename DX>
+Result basic_optimization<F, DX>::grid() {
+  if (parameters.divisions.size() != parameters.domains.size()) {
+    throw std::invalid_argument("Number of divisions must be 1 or equal to "
+                                "number of domains.");
+  }
+  incumbent best_ever(parameters.domains.size());
+  std::atomic<bool> stop(false);
+  std::vector<double> step_size(parameters.domains.size());
+  unsigned first = 0;
+  if (resuming_) {
+    first = resume_.position;
+    func_calls_ = resume_.calls;
+    parameters.domains = resume_.domains;
+    if (!resume_.best.empty())
+      best_ever.offer(resume_.lowest, resume_.best.data());
+    resuming_ = false;
+  }
+
+  for (unsigned g = first; g < parameters.generations && !stop; g++) {
+    if (g > first) {
+      std::vector<double> centre = best_ever.get().second;
+      for (size_t i = 0; i < parameters.domains.size(); i++) {
+        parameters.domains[i] = {
+            std::max(centre[i] - step_size[i], original_domains_[i].first),
+            std::min(centre[i] + step_size[i], original_domains_[i].second)};
+      }
+    }
+    for (size_t i = 0; i < step_size.size(); i++) {
+      step_size[i] =
+          (parameters.domains[i].second - parameters.domains[i].first) /
+          parameters.divisions[i];
+    }
+    unsigned calls = func_calls_;
+    auto state = [&] {
+      checkpoint c;
+      c.position = g;
+      c.calls = calls;
+      c.domains = parameters.domains;
+      std::tie(c.lowest, c.best) = best_ever.get();
+      return c;
+    };
+    checkpoint_if_due(state);
+    // All the passes of a generation are handed to the pool at once, and
+    // the sweeps within them are split up further when threads run out of
+    // passes.
+    pool().run(parameters.passes, [&](size_t p) {
+      if (!stop && !interrupted())
+        single_pass(g, p, step_size, best_ever, stop);
+    });
+    if (interrupted()) {
+      checkpoint_if_due(state, true);
+      break;
+    }
+  }
+  auto found = best_ever.get();
+  return {found.first, found.second, func_calls_};
+}
+
+// GSL's vectors are contiguous unless they are views with a stride, so
+// the objective and gradient can normally work on them in place.
+template <typename F, typename DX>
+double basic_optimization<F, DX>::exec_func_gsl(const gsl_vector *v,
+                                                void *params) {
+  auto o = static_cast<basic_optimization *>(params);
+  o->gsl_calls_++;
+  if (v->stride == 1)
+    return o->exec_func(v->data, v->size);
+  std::vector<double> v_copy(v->size);
+  for (size_t i = 0; i < v->size; i++)
+    v_copy[i] = gsl_vector_get(v, i);
+  return o->exec_func(v_copy.data(), v_copy.size());
+}
+
+template <typename F, typename DX>
+void basic_optimization<F, DX>::exec_func_gsl_df(const gsl_vector *v,
+                                                 void *params, gsl_vector *df) {
+  auto o = static_cast<basic_optimization *>(params);
+  if (v->stride == 1 && df->stride == 1) {
+    o->dx_(v->data, v->size, df->data);
+    return;
+  }
+  std::vector<double> v_copy(v->size), df_vec(v->size);
+  for (size_t i = 0; i < v->size; i++)
+    v_copy[i] = gsl_vector_get(v, i);
+  o->dx_(v_copy.data(), v_copy.size(), df_vec.data());
+  for (size_t i = 0; i < df_vec.size(); i++) {
+    gsl_vector_set(df, i, df_vec[i]);
+  }
+}
+
+template <typename F, typename DX>
+void basic_optimization<F, DX>::exec_func_gsl_combined(const gsl_vector *x,
+                                                       void *params, double *f,
+                                                       gsl_vector *df) {
+  *f = exec_func_gsl(x, params);
+  exec_func_gsl_df(x, params, df);
+}
+
+template <typename F, typename DX>
+Result basic_optimization<F, DX>::nelder_mead_simplex() {
+  const gsl_multimin_fminimizer_type *T = gsl_multimin_fminimizer_nmsimplex2;
+  gsl_multimin_fminimizer *s = NULL;
+  gsl_vector *ss, *x;
+  gsl_multimin_function minex_func;
+
+  size_t iter = 0;
+  int status;
+
+  /* Starting point, or where a checkpoint left off. GSL's simplex can't be
+     saved, so a resumed run builds a new one around that point. */
+  x = gsl_vector_alloc(parameters.domains.size());
+  draw(0, 0, 0, x->data);
+  if (resuming_ && !resume_.best.empty()) {
+    std::copy(resume_.best.begin(), resume_.best.end(), x->data);
+    iter = resume_.position;
+    func_calls_ = resume_.calls;
+  }
+  resuming_ = false;
+
+  /* Set initial step sizes to 1 */
+  ss = gsl_vector_alloc(parameters.domains.size());
+  gsl_vector_set_all(ss, 1.0);
+
+  /* Initialize method and iterate */
+  minex_func.n = parameters.domains.size();
+  minex_func.f = exec_func_gsl;
+  minex_func.params = this;
+
+  s = gsl_multimin_fminimizer_alloc(T, parameters.domains.size());
+  gsl_multimin_fminimizer_set(s, &minex_func, x, ss);
+
+  auto state = [&] {
+    checkpoint c;
+    c.position = iter;
+    c.calls = func_calls_ + gsl_calls_;
+    c.lowest = s->fval;
+    c.best.assign(s->x->data, s->x->data + s->x->size);
+    return c;
+  };
+  do {
+    iter++;
+    status = gsl_multimin_fminimizer_iterate(s);
+
+    if (status)
+      break;
+
+    double size = gsl_multimin_fminimizer_size(s);
+    status = gsl_multimin_test_size(size, parameters.error);
+    checkpoint_if_due(state, interrupted() != 0);
+  } while (status == GSL_CONTINUE && iter < parameters.iterations &&
+           !interrupted());
+
+  gsl_vector_free(x);
+  gsl_vector_free(ss);
+  double lowest = s->fval;
+  std::vector<double> best(s->x->data, s->x->data + s->x->size);
+  gsl_multimin_fminimizer_free(s);
+  func_calls_ += gsl_calls_;
+  gsl_calls_ = 0;
+  own_value(best, lowest);
+  return {lowest, best, func_calls_};
+}
+
+template <typename F, typename DX>
+Result basic_optimization<F, DX>::gradient_descent() {
+  const gsl_multimin_fdfminimizer_type *T;
+  gsl_multimin_fdfminimizer *s;
+  gsl_vector *x;
+  gsl_multimin_function_fdf min_gsl;
+
+  size_t iter = 0;
+
+  min_gsl.n = parameters.domains.size();
+  min_gsl.f = exec_func_gsl;
+  min_gsl.df = exec_func_gsl_df;
+  min_gsl.fdf = exec_func_gsl_combined;
+  min_gsl.params = this;
+
+  // As with the simplex, a resumed run starts afresh from the checkpoint.
+  x = gsl_vector_alloc(parameters.domains.size());
+  draw(0, 0, 0, x->data);
+  if (resuming_ && !resume_.best.empty()) {
+    std::copy(resume_.best.begin(), resume_.best.end(), x->data);
+    iter = resume_.position;
+    func_calls_ = resume_.calls;
+  }
+  resuming_ = false;
+
+  T = gsl_multimin_fdfminimizer_conjugate_fr;
+  s = gsl_multimin_fdfminimizer_alloc(T, parameters.domains.size());
+
+  gsl_multimin_fdfminimizer_set(s, &min_gsl, x, parameters.step_size,
+                                parameters.tol);
+
+  auto state = [&] {
+    checkpoint c;
+    c.position = iter;
+    c.calls = func_calls_ + gsl_calls_;
+    c.lowest = s->f;
+    c.best.assign(s->x->data, s->x->data + s->x->size);
+    return c;
+  };
+  int status;
+  do {
+    iter++;
+    status = gsl_multimin_fdfminimizer_iterate(s);
+
+    if (status)
+      break;
+
+    status = gsl_multimin_test_gradient(s->gradient, parameters.abstol);
+    checkpoint_if_due(state, interrupted() != 0);
+  } while (status == GSL_CONTINUE && iter < parameters.iterations &&
+           !interrupted());
+
+  gsl_vector_free(x);
+  double lowest = s->f;
+  std::vector<double> best(s->x->data, s->x->data + s->x->size);
+  gsl_multimin_fdfminimizer_free(s);
+  func_calls_ += gsl_calls_;
+  gsl_calls_ = 0;
+  own_value(best, lowest);
+  return {lowest, best, func_calls_};
+}
 } // namespace Fit
 #endif
@@ -0,0 +1,96 @@
+/**
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Prints an evaluation log written with fit --log as CSV or JSON lines.
+// The log may be read while fit is still writing it.
+
+#include "fit.hpp"
+#include <boost/program_options.hpp>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+void print_csv(const std::vector<Fit::log_record> &records) {
+    size_t n = records.empty() ? 0 : records[0].x.size();
+    printf("time,wall,thread,y");
+    for (size_t j = 0; j < n; j++)
+        printf(",x%zu", j);
+    printf("\n");
+    for (auto &r : records) {
+        printf("%lld,%lld,%u,%.17g", (long long)r.time, (long long)r.wall,
+               r.thread, r.y);
+        for (double v : r.x)
+            printf(",%.17g", v);
+        printf("\n");
+    }
+}
+
+// One object per line. JSON has no NAN, so failed evaluations are null.
+void print_json(const std::vector<Fit::log_record> &records) {
+    for (auto &r : records) {
+        printf("{\"time\": %lld, \"wall\": %lld, \"thread\": %u, \"y\": ",
+               (long long)r.time, (long long)r.wall, r.thread);
+        printf(std::isfinite(r.y) ? "%.17g" : "null", r.y);
+        printf(", \"x\": [");
+        for (size_t j = 0; j < r.x.size(); j++)
+            printf(j ? ", %.17g" : "%.17g", r.x[j]);
+        printf("]}\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    po::options_description options("Print an evaluation log");
+    options.add_options()("help,h", "produce help message")
+        ("format", po::value<std::string>()->default_value("csv"),
+         "csv, with a header line, or json, one object per line")
+        ("log", po::value<std::string>(), "file written with fit --log");
+    po::positional_options_description positional;
+    positional.add("log", 1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv)
+                      .options(options)
+                      .positional(positional)
+                      .run(),
+                  vm);
+        po::notify(vm);
+    } catch (const std::exception &e) {
+        std::cerr << "Error on command line: " << e.what() << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::string format = vm["format"].as<std::string>();
+    if (vm.count("help") || !vm.count("log") ||
+        (format != "csv" && format != "json")) {
+        std::cout << "Usage: " << argv[0] << " [options] log\n" << options;
+        exit(vm.count("help") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    try {
+        auto records = Fit::read_log(vm["log"].as<std::string>());
+        if (format == "csv")
+            print_csv(records);
+        else
+            print_json(records);
+    } catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Interface for models loaded into fit as shared libraries with
+ *
+ *      fit -f plugin:/path/libmodel.so:model --dx plugin:/path/libmodel.so:model_dx
+ *
+ * The library exports the objective function, and optionally its gradient,
+ * with C linkage and the signatures below. For a function called model the
+ * library may also export
+ *
+ *      void *model_init(size_t n);
+ *      void model_teardown(void *ctx);
+ *
+ * model_init is called once, with the number of variables, before the first
+ * evaluation and whatever it returns is passed as ctx to every call of model.
+ * model_teardown is called with the same ctx when fit is finished with the
+ * model. Without model_init, ctx is NULL.
+ *
+ * Evaluations happen on the optimizer threads, so the functions must be safe
+ * to call concurrently with the same ctx.
+ */
+#ifndef FIT_PLUGIN_H
+#define FIT_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef double (*fit_plugin_func)(size_t n, const double *x, void *ctx);
+typedef void (*fit_plugin_dx)(size_t n, const double *x, double *dx,
+                              void *ctx);
+typedef void *(*fit_plugin_init)(size_t n);
+typedef void (*fit_plugin_teardown)(void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Binary protocol for models called by fit with --protocol binary.
+ *
+ * fit sends each vector as a frame on the model's stdin and expects a frame
+ * back on its stdout: a 32 bit little-endian count n followed by n
+ * little-endian IEEE 754 doubles. An objective function replies with a frame
+ * holding one value, a gradient with a frame holding one value per variable.
+ *
+ * A model that loops until fit_read_frame() returns -1 works both for
+ * --function external, which sends one frame and closes stdin, and for
+ * --function external-persistent, which keeps sending frames.
+ *
+ *      double *x = NULL;
+ *      size_t cap = 0;
+ *      long n;
+ *      while ((n = fit_read_frame(stdin, &x, &cap)) >= 0) {
+ *              double y = model(x, n);
+ *              fit_write_frame(stdout, &y, 1);
+ *      }
+ *      free(x);
+ */
+#ifndef FIT_PROTOCOL_H
+#define FIT_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The most values fit_read_frame() accepts in a frame. A larger count is
+ * taken as a corrupt frame rather than allocated. */
+#ifndef FIT_FRAME_MAX
+#define FIT_FRAME_MAX (1u << 24)
+#endif
+
+/* Reads a frame of at most max values into *x, growing it with realloc when
+ * *cap is too small. Returns the number of values read, or -1 at end of
+ * input, on error or if the frame is larger than max. */
+static inline long fit_read_frame_max(FILE *f, double **x, size_t *cap,
+                                      uint32_t max)
+{
+        unsigned char header[4];
+        if (fread(header, 1, sizeof header, f) != sizeof header)
+                return -1;
+        uint32_t n = (uint32_t) header[0] | (uint32_t) header[1] << 8 |
+                (uint32_t) header[2] << 16 | (uint32_t) header[3] << 24;
+        if (n > max)
+                return -1;
+        if (n > *cap) {
+                double *p = (double *) realloc(*x, n * sizeof(double));
+                if (p == NULL)
+                        return -1;
+                *x = p;
+                *cap = n;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+                unsigned char b[8];
+                if (fread(b, 1, sizeof b, f) != sizeof b)
+                        return -1;
+                uint64_t u = 0;
+                for (int j = 0; j < 8; j++)
+                        u |= (uint64_t) b[j] << (8 * j);
+                memcpy(&(*x)[i], &u, sizeof u);
+        }
+        return n;
+}
+
+/* Reads a frame of up to FIT_FRAME_MAX values. */
+static inline long fit_read_frame(FILE *f, double **x, size_t *cap)
+{
+        return fit_read_frame_max(f, x, cap, FIT_FRAME_MAX);
+}
+
+/* Writes n values as a frame and flushes f. Returns 0 on success. */
+static inline int fit_write_frame(FILE *f, const double *x, uint32_t n)
+{
+        unsigned char header[4] = {
+                (unsigned char) (n & 0xff), (unsigned char) ((n >> 8) & 0xff),
+                (unsigned char) ((n >> 16) & 0xff), (unsigned char) (n >> 24)
+        };
+        if (fwrite(header, 1, sizeof header, f) != sizeof header)
+                return -1;
+        for (uint32_t i = 0; i < n; i++) {
+                unsigned char b[8];
+                uint64_t u;
+                memcpy(&u, &x[i], sizeof u);
+                for (int j = 0; j < 8; j++)
+                        b[j] = (u >> (8 * j)) & 0xff;
+                if (fwrite(b, 1, sizeof b, f) != sizeof b)
+                        return -1;
+        }
+        return fflush(f) == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * Shared memory transport for models called by fit with
+ *
+ *      fit -f external-shm -c model
+ *
+ * fit creates a ring of slots in /dev/shm and starts the model (--workers
+ * copies of it) with the name of the segment in the FIT_SHM environment
+ * variable. Optimizer threads write candidate vectors into free slots and the
+ * model processes take them in ticket order, write their reply into the same
+ * slot and move on. Waiting is done by spinning briefly and then sleeping on
+ * a futex, so no pipes or text formatting are involved.
+ *
+ * A model only needs the four functions at the bottom of this file:
+ *
+ *      struct fit_shm shm;
+ *      if (fit_shm_attach(&shm) != 0)
+ *              exit(EXIT_FAILURE);
+ *      const double *x;
+ *      long n;
+ *      while ((n = fit_shm_next(&shm, &x)) >= 0) {
+ *              double y = model(x, n);
+ *              fit_shm_reply(&shm, &y, 1);
+ *      }
+ *      fit_shm_detach(&shm);
+ *
+ * An objective function replies with one value, a gradient with one value per
+ * variable. fit_shm_next() returns -1 once fit is finished.
+ *
+ * The layout and the helpers are shared with fit itself, so this header must
+ * stay valid C and C++. Linux only.
+ */
+#ifndef FIT_SHM_H
+#define FIT_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FIT_SHM_MAGIC 0x46495453u /* "FITS" */
+#define FIT_SHM_ENV "FIT_SHM"
+#define FIT_SHM_SPINS 2000
+
+enum { FIT_SHM_EMPTY = 0, FIT_SHM_REQUEST = 1, FIT_SHM_DONE = 2 };
+
+struct fit_shm_header {
+        uint32_t magic;
+        uint32_t slots;
+        uint32_t capacity; /* largest vector or reply a slot holds */
+        uint32_t closed;   /* set by fit when it is finished */
+        uint32_t head;     /* next ticket for a model process */
+        uint32_t tail;     /* next ticket for an optimizer thread */
+        uint32_t doorbell; /* bumped whenever a request is posted */
+        uint32_t sleepers; /* model processes asleep on the doorbell */
+};
+
+/* Each slot is followed by capacity doubles for the request and capacity
+ * doubles for the reply. Ticket t uses slot t % slots on lap t / slots. */
+struct fit_shm_slot {
+        uint32_t lap;
+        uint32_t state;
+        uint32_t n; /* values in the request */
+        uint32_t m; /* values in the reply */
+        uint32_t waiting; /* optimizer thread asleep on state */
+        uint32_t pad;
+};
+
+static inline size_t fit_shm_slot_size(uint32_t capacity)
+{
+        return sizeof(struct fit_shm_slot) + 2 * (size_t) capacity * sizeof(double);
+}
+
+static inline size_t fit_shm_size(uint32_t slots, uint32_t capacity)
+{
+        return sizeof(struct fit_shm_header) + slots * fit_shm_slot_size(capacity);
+}
+
+static inline struct fit_shm_slot *fit_shm_slot_at(struct fit_shm_header *h,
+                                                   uint32_t ticket)
+{
+        char *base = (char *) (h + 1);
+        return (struct fit_shm_slot *) (base + (ticket % h->slots) *
+                                        fit_shm_slot_size(h->capacity));
+}
+
+static inline double *fit_shm_request(struct fit_shm_slot *s)
+{
+        return (double *) (s + 1);
+}
+
+static inline double *fit_shm_reply_data(struct fit_shm_header *h,
+                                         struct fit_shm_slot *s)
+{
+        return (double *) (s + 1) + h->capacity;
+}
+
+static inline uint32_t fit_shm_load(uint32_t *p)
+{
+        return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void fit_shm_store(uint32_t *p, uint32_t v)
+{
+        __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t fit_shm_add(uint32_t *p, uint32_t v)
+{
+        return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+/* Sleeps while *p == v, for at most timeout_ns if it is not 0. The mapping
+ * is shared between processes, so the futex can't be FUTEX_PRIVATE. */
+static inline void fit_shm_wait(uint32_t *p, uint32_t v, long timeout_ns)
+{
+        struct timespec ts = {timeout_ns / 1000000000L, timeout_ns % 1000000000L};
+        syscall(SYS_futex, p, FUTEX_WAIT, v, timeout_ns ? &ts : NULL, NULL, 0);
+}
+
+static inline void fit_shm_wake(uint32_t *p)
+{
+        syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Model side */
+
+struct fit_shm {
+        struct fit_shm_header *h;
+        size_t size;
+        struct fit_shm_slot *slot; /* slot being worked on */
+};
+
+/* Maps the segment named in FIT_SHM. Returns 0 on success. */
+static inline int fit_shm_attach(struct fit_shm *shm)
+{
+        const char *name = getenv(FIT_SHM_ENV);
+        if (name == NULL)
+                return -1;
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+                return -1;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+                close(fd);
+                return -1;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+                return -1;
+        shm->h = (struct fit_shm_header *) p;
+        shm->size = st.st_size;
+        shm->slot = NULL;
+        if (shm->h->magic != FIT_SHM_MAGIC) {
+                munmap(p, shm->size);
+                return -1;
+        }
+        return 0;
+}
+
+/* Waits for the next request and points *x at it. Returns the number of
+ * values, or -1 when fit is finished. */
+static inline long fit_shm_next(struct fit_shm *shm, const double **x)
+{
+        struct fit_shm_header *h = shm->h;
+        uint32_t ticket = fit_shm_add(&h->head, 1);
+        uint32_t lap = ticket / h->slots;
+        struct fit_shm_slot *s = fit_shm_slot_at(h, ticket);
+        for (unsigned spins = 0;; spins++) {
+                uint32_t bell = fit_shm_load(&h->doorbell);
+                if (fit_shm_load(&s->state) == FIT_SHM_REQUEST &&
+                    fit_shm_load(&s->lap) == lap)
+                        break;
+                if (fit_shm_load(&h->closed))
+                        return -1;
+                if (spins < FIT_SHM_SPINS)
+                        continue;
+                fit_shm_add(&h->sleepers, 1);
+                fit_shm_wait(&h->doorbell, bell, 0);
+                fit_shm_add(&h->sleepers, -1);
+        }
+        shm->slot = s;
+        *x = fit_shm_request(s);
+        return s->n;
+}
+
+/* Sends the reply to the request last returned by fit_shm_next(). */
+static inline void fit_shm_reply(struct fit_shm *shm, const double *y, uint32_t m)
+{
+        struct fit_shm_slot *s = shm->slot;
+        if (m > shm->h->capacity)
+                m = shm->h->capacity;
+        double *reply = fit_shm_reply_data(shm->h, s);
+        for (uint32_t i = 0; i < m; i++)
+                reply[i] = y[i];
+        s->m = m;
+        fit_shm_store(&s->state, FIT_SHM_DONE);
+        if (fit_shm_load(&s->waiting))
+                fit_shm_wake(&s->state);
+        shm->slot = NULL;
+}
+
+static inline void fit_shm_detach(struct fit_shm *shm)
+{
+        munmap(shm->h, shm->size);
+}
+
+#endif
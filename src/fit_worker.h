@@ -0,0 +1,324 @@
+/*
+ * Worker harness for models that are slow to initialise but keep mutable
+ * global state, so one process can't safely evaluate many vectors in a row.
+ *
+ * The model hands its functions to fit_worker_main(), which runs init once
+ * and then forks a copy-on-write child of the initialised process to do the
+ * evaluations. Every child starts from the state init left behind, so each
+ * evaluation sees a clean slate while the init cost is paid only once per
+ * worker:
+ *
+ *      static void *init(int argc, char *argv[])
+ *      {
+ *              return load_data_and_build_network();
+ *      }
+ *
+ *      static long eval(void *ctx, const double *x, long n, double *y)
+ *      {
+ *              y[0] = run_model(ctx, x, n);
+ *              return 1;
+ *      }
+ *
+ *      int main(int argc, char *argv[])
+ *      {
+ *              struct fit_worker_model model = {init, eval};
+ *              return fit_worker_main(argc, argv, &model);
+ *      }
+ *
+ * eval writes its reply to y, which has room for n values, and returns the
+ * number of values written: 1 for an objective function, n for a gradient.
+ * Returning 0 sends an empty reply. A negative return, or a child that
+ * crashes, is answered with NANs and the child is replaced.
+ *
+ * The program then talks to fit like the other external models do:
+ *
+ *      fit -f external-persistent -c "model"            one line per vector
+ *      fit -f external-persistent -c "model --binary" --protocol binary
+ *      fit -f external-shm -c "model --shm"
+ *      fit -f external -c "model"                       vector on argv
+ *
+ * By default a child is forked for every evaluation. With --batch K a child
+ * evaluates up to K vectors before it is replaced, which trades some of the
+ * isolation for fewer forks. init is given the program's arguments as they
+ * are; anything after the options above is taken as a vector to evaluate
+ * once. A child's stdout is redirected to stderr so that stray output from
+ * the model can't corrupt the replies.
+ *
+ * Linux only. The header is valid C and C++.
+ */
+#ifndef FIT_WORKER_H
+#define FIT_WORKER_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fit_protocol.h"
+#include "fit_shm.h"
+
+struct fit_worker_model {
+        void *(*init)(int argc, char *argv[]); /* may be NULL */
+        long (*eval)(void *ctx, const double *x, long n, double *y);
+};
+
+/* The forked child currently serving evaluations, if any. */
+struct fit_worker {
+        const struct fit_worker_model *model;
+        void *ctx;
+        unsigned long batch; /* evaluations per child */
+        unsigned long left;  /* evaluations left for the current child */
+        pid_t pid;
+        FILE *to;   /* requests to the child */
+        FILE *from; /* replies from the child */
+        long m;     /* size of the last good reply, used for NAN replies */
+        double *y;
+        size_t cap;
+};
+
+/* Child side: evaluate frames from the parent until it closes the pipe. An
+ * evaluation that fails ends the child without a reply, which is how the
+ * parent tells it apart from an empty one. */
+static inline void fit_worker_child(struct fit_worker *w, FILE *in, FILE *out)
+{
+        double *x = NULL;
+        size_t cap = 0;
+        long n;
+        while ((n = fit_read_frame(in, &x, &cap)) >= 0) {
+                double *y = (double *) malloc((n > 0 ? n : 1) * sizeof(double));
+                long m = y ? w->model->eval(w->ctx, x, n, y) : -1;
+                if (m < 0 || m > (n > 0 ? n : 1))
+                        _exit(EXIT_FAILURE);
+                fit_write_frame(out, y, (uint32_t) m);
+                free(y);
+        }
+        free(x);
+}
+
+static inline void fit_worker_retire(struct fit_worker *w)
+{
+        if (w->pid <= 0)
+                return;
+        fclose(w->to);
+        fclose(w->from);
+        waitpid(w->pid, NULL, 0);
+        w->pid = 0;
+}
+
+/* A pipe whose ends are closed on exec, so that anything the model starts
+ * doesn't hold them open and hide a child's death. The worker is single
+ * threaded, so nothing can exec between pipe() and fcntl(). */
+static inline int fit_worker_pipe(int fds[2])
+{
+        if (pipe(fds) != 0)
+                return -1;
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        return 0;
+}
+
+static inline int fit_worker_fork(struct fit_worker *w)
+{
+        int request[2], reply[2];
+        if (fit_worker_pipe(request) != 0)
+                return -1;
+        if (fit_worker_pipe(reply) != 0) {
+                close(request[0]);
+                close(request[1]);
+                return -1;
+        }
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0) {
+                close(request[0]);
+                close(request[1]);
+                close(reply[0]);
+                close(reply[1]);
+                return -1;
+        }
+        if (pid == 0) {
+                close(request[1]);
+                close(reply[0]);
+                dup2(STDERR_FILENO, STDOUT_FILENO);
+                FILE *in = fdopen(request[0], "r");
+                FILE *out = fdopen(reply[1], "w");
+                if (in && out)
+                        fit_worker_child(w, in, out);
+                _exit(0);
+        }
+        close(request[0]);
+        close(reply[1]);
+        w->to = fdopen(request[1], "w");
+        w->from = fdopen(reply[0], "r");
+        w->pid = pid;
+        w->left = w->batch;
+        return 0;
+}
+
+/* Evaluates x in a child and returns the number of values in w->y. A child
+ * that dies or fails is answered with NANs, as many as the last good reply
+ * had. */
+static inline long fit_worker_eval(struct fit_worker *w, const double *x, long n)
+{
+        long m = -1;
+        if (w->pid == 0 || w->left == 0) {
+                fit_worker_retire(w);
+                if (fit_worker_fork(w) != 0)
+                        w->pid = 0;
+        }
+        if (w->pid > 0) {
+                w->left--;
+                /* The child never replies with more than n values, or 1. */
+                if (fit_write_frame(w->to, x, (uint32_t) n) == 0)
+                        m = fit_read_frame_max(w->from, &w->y, &w->cap,
+                                               n > 0 ? (uint32_t) n : 1);
+                if (m < 0)
+                        fit_worker_retire(w);
+        }
+        if (m >= 0) {
+                if (m > 0)
+                        w->m = m;
+                return m;
+        }
+        m = w->m;
+        if ((size_t) m > w->cap) {
+                double *p = (double *) realloc(w->y, m * sizeof(double));
+                if (p == NULL)
+                        return 0;
+                w->y = p;
+                w->cap = m;
+        }
+        for (long i = 0; i < m; i++)
+                w->y[i] = NAN;
+        return m;
+}
+
+/* One vector per line on stdin, one line per reply on stdout. */
+static inline void fit_worker_text(struct fit_worker *w)
+{
+        char *line = NULL;
+        size_t len = 0;
+        double *x = NULL;
+        size_t cap = 0;
+        while (getline(&line, &len, stdin) != -1) {
+                char *p = line, *end;
+                long n = 0;
+                for (double d = strtod(p, &end); end != p; d = strtod(p, &end)) {
+                        if ((size_t) n == cap) {
+                                cap = cap ? 2 * cap : 16;
+                                x = (double *) realloc(x, cap * sizeof(double));
+                                if (x == NULL)
+                                        exit(EXIT_FAILURE);
+                        }
+                        x[n++] = d;
+                        p = end;
+                }
+                long m = fit_worker_eval(w, x, n);
+                for (long i = 0; i < m; i++)
+                        printf(i ? " %.17g" : "%.17g", w->y[i]);
+                printf("\n");
+                fflush(stdout);
+        }
+        free(line);
+        free(x);
+}
+
+static inline void fit_worker_binary(struct fit_worker *w)
+{
+        double *x = NULL;
+        size_t cap = 0;
+        long n;
+        while ((n = fit_read_frame(stdin, &x, &cap)) >= 0) {
+                long m = fit_worker_eval(w, x, n);
+                fit_write_frame(stdout, w->y, (uint32_t) m);
+        }
+        free(x);
+}
+
+static inline int fit_worker_shared(struct fit_worker *w)
+{
+        struct fit_shm shm;
+        if (fit_shm_attach(&shm) != 0) {
+                fprintf(stderr, "Can't attach to fit's shared memory.\n");
+                return -1;
+        }
+        const double *x;
+        long n;
+        while ((n = fit_shm_next(&shm, &x)) >= 0) {
+                long m = fit_worker_eval(w, x, n);
+                fit_shm_reply(&shm, w->y, (uint32_t) m);
+        }
+        fit_shm_detach(&shm);
+        return 0;
+}
+
+/* A vector on the command line is evaluated directly: the process is
+ * already a clean slate and exits afterwards. */
+static inline int fit_worker_once(struct fit_worker *w, int argc, char *argv[])
+{
+        double *x = (double *) malloc(argc * sizeof(double));
+        double *y = (double *) malloc(argc * sizeof(double));
+        if (x == NULL || y == NULL)
+                return -1;
+        for (int i = 0; i < argc; i++)
+                x[i] = atof(argv[i]);
+        long m = w->model->eval(w->ctx, x, argc, y);
+        for (long i = 0; i < m; i++)
+                printf(i ? " %.17g" : "%.17g", y[i]);
+        printf("\n");
+        free(x);
+        free(y);
+        return m < 0 ? -1 : 0;
+}
+
+static inline int fit_worker_main(int argc, char *argv[],
+                                  const struct fit_worker_model *model)
+{
+        struct fit_worker w;
+        memset(&w, 0, sizeof w);
+        w.model = model;
+        w.batch = 1;
+        w.m = 1;
+
+        enum { TEXT, BINARY, SHM } mode = TEXT;
+        int i = 1;
+        for (; i < argc; i++) {
+                if (strcmp(argv[i], "--binary") == 0) {
+                        mode = BINARY;
+                } else if (strcmp(argv[i], "--shm") == 0) {
+                        mode = SHM;
+                } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+                        w.batch = strtoul(argv[++i], NULL, 10);
+                        if (w.batch == 0)
+                                w.batch = 1;
+                } else {
+                        break;
+                }
+        }
+        if (model->init)
+                w.ctx = model->init(argc, argv);
+
+        /* The vector on the command line. */
+        if (mode == TEXT && i < argc)
+                return fit_worker_once(&w, argc - i, argv + i) == 0 ?
+                        EXIT_SUCCESS : EXIT_FAILURE;
+
+        signal(SIGPIPE, SIG_IGN);
+        int status = 0;
+        if (mode == TEXT)
+                fit_worker_text(&w);
+        else if (mode == BINARY)
+                fit_worker_binary(&w);
+        else
+                status = fit_worker_shared(&w);
+        fit_worker_retire(&w);
+        free(w.y);
+        return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
@@ -30,10 +30,80 @@ void process_options(int argc, char *argv[], Fit::Parameters &parameters) {
                 "number of variables")(
                     "method,m", po::value<std::string>(), "optimization method")(
                     "function,f", po::value<std::string>(),
-                    "function to optimize")("command,c", po::value<std::string>(),
-                        "command line for when function==external")(
+                    "function to optimize, or plugin:path:symbol to load it "
+                    "from a shared library")("command,c", po::value<std::string>(),
+                        "command line for when function==external, external-async, "
+                        "external-persistent or external-shm")(
                             "error,e", po::value<double>(), "minimum error stop condition")(
                             "threads,t", po::value<unsigned>(), "number of threads")
+                            ("protocol", po::value<std::string>(),
+                             "how vectors are passed to external models: "
+                             "text or binary")
+                            ("external-batch", po::value<unsigned>(),
+                             "send this many vectors to each external program "
+                             "on its stdin instead of one on its command line")
+                            ("batch", po::value<unsigned>(),
+                             "number of candidates random search hands to the "
+                             "function at once (default: automatic, 64 for "
+                             "the built-in functions). --error is checked "
+                             "after each batch, so use 1 to stop at the "
+                             "first point below it")
+                            ("in-flight", po::value<unsigned>(),
+                             "number of external-async programs to run at once "
+                             "(default: one per thread)")
+                            ("workers,w", po::value<unsigned>(),
+                             "number of model processes for external-persistent "
+                             "and external-shm (default: one per thread)")
+                            ("timeout", po::value<double>(),
+                             "seconds an external evaluation may run before it "
+                             "is killed and scores the penalty, not for "
+                             "external-shm (default: no limit)")
+                            ("penalty", po::value<double>(),
+                             "value of an external evaluation that timed out "
+                             "(default: nan)")
+                            ("speculate", po::value<double>(),
+                             "start a second external-async program for an "
+                             "evaluation that has run this many times the median "
+                             "call time, if a slot is free (default: never)")
+                            ("simd", po::value<std::string>(),
+                             "kernels for the built-in test functions: scalar, "
+                             "sse2, avx2 or avx512 (default: the widest this "
+                             "CPU supports)")
+                            ("seed", po::value<uint64_t>(),
+                             "seed for the random numbers the methods draw, "
+                             "which makes runs repeatable whatever the number "
+                             "of threads; any value, 0 included, may be given "
+                             "(default: a random seed)")
+                            ("cache", po::value<unsigned>(),
+                             "megabytes of objective values to remember, so "
+                             "points visited again aren't evaluated again "
+                             "(default: no cache)")
+                            ("cache-quantum", po::value<double>(),
+                             "round variables to multiples of this when "
+                             "looking points up in the cache (default: exact)")
+                            ("store", po::value<std::string>(),
+                             "file to keep objective values in between runs, "
+                             "which runs at the same time can share")
+                            ("store-tag", po::value<std::string>(),
+                             "version of the model, so that values stored for "
+                             "other versions aren't used")
+                            ("reuse-radius", po::value<double>(),
+                             "use the value of an evaluated point instead of "
+                             "evaluating one within this fraction of each "
+                             "domain of it (default: 0, never)")
+                            ("checkpoint", po::value<std::string>(),
+                             "file to save progress in, every "
+                             "--checkpoint-interval seconds and on SIGINT or "
+                             "SIGTERM")
+                            ("checkpoint-interval", po::value<double>(),
+                             "seconds between checkpoints (default: 60)")
+                            ("resume", po::value<std::string>(),
+                             "carry on from a checkpoint, saving later ones to "
+                             "the same file unless --checkpoint is given")
+                            ("log", po::value<std::string>(),
+                             "file to record every evaluation in, with its "
+                             "value, time, duration and thread; print it "
+                             "with fit_log")
                             ("check", po::value<bool>(),
                              "check that parameters are sensible before optimizing");
 
@@ -53,9 +123,11 @@ void process_options(int argc, char *argv[], Fit::Parameters &parameters) {
     po::options_description grad("Gradient descent method");
     grad.add_options()(
             "dx,x", po::value<std::string>(),
-            "function to calculate the derivative of the function being optimized")(
+            "function to calculate the derivative of the function being optimized, "
+            "or plugin:path:symbol")(
                 "command_dx,y", po::value<std::string>(),
-                "command line for when dx==external")(
+                "command line for when dx==external, external-async, "
+                "external-persistent or external-shm")(
                     "step", po::value<double>(),
                     "GNU Scientific Library step size for gradient descent")(
                         "tol", po::value<double>(),
@@ -100,6 +172,10 @@ void process_options(int argc, char *argv[], Fit::Parameters &parameters) {
         parameters.command = vm["command"].as<std::string>();
     }
 
+    if (vm.count("protocol")) {
+        parameters.protocol = vm["protocol"].as<std::string>();
+    }
+
     if (vm.count("command_dx")) {
         parameters.command_dx = vm["command_dx"].as<std::string>();
     }
@@ -151,6 +227,78 @@ void process_options(int argc, char *argv[], Fit::Parameters &parameters) {
     if (vm.count("threads")) {
         parameters.threads = vm["threads"].as<unsigned>();
     }
+
+    if (vm.count("external-batch")) {
+        parameters.external_batch = vm["external-batch"].as<unsigned>();
+    }
+
+    if (vm.count("batch")) {
+        parameters.batch = vm["batch"].as<unsigned>();
+    }
+
+    if (vm.count("in-flight")) {
+        parameters.in_flight = vm["in-flight"].as<unsigned>();
+    }
+
+    if (vm.count("workers")) {
+        parameters.workers = vm["workers"].as<unsigned>();
+    }
+
+    if (vm.count("timeout")) {
+        parameters.timeout = vm["timeout"].as<double>();
+    }
+
+    if (vm.count("penalty")) {
+        parameters.penalty = vm["penalty"].as<double>();
+    }
+
+    if (vm.count("speculate")) {
+        parameters.speculate = vm["speculate"].as<double>();
+    }
+
+    if (vm.count("seed")) {
+        parameters.seed = vm["seed"].as<uint64_t>();
+    }
+
+    if (vm.count("cache")) {
+        parameters.cache = vm["cache"].as<unsigned>();
+    }
+
+    if (vm.count("cache-quantum")) {
+        parameters.cache_quantum = vm["cache-quantum"].as<double>();
+    }
+
+    if (vm.count("store")) {
+        parameters.store = vm["store"].as<std::string>();
+    }
+
+    if (vm.count("store-tag")) {
+        parameters.store_tag = vm["store-tag"].as<std::string>();
+    }
+
+    if (vm.count("reuse-radius")) {
+        parameters.reuse_radius = vm["reuse-radius"].as<double>();
+    }
+
+    if (vm.count("checkpoint")) {
+        parameters.checkpoint = vm["checkpoint"].as<std::string>();
+    }
+
+    if (vm.count("checkpoint-interval")) {
+        parameters.checkpoint_interval = vm["checkpoint-interval"].as<double>();
+    }
+
+    if (vm.count("resume")) {
+        parameters.resume = vm["resume"].as<std::string>();
+    }
+
+    if (vm.count("log")) {
+        parameters.log = vm["log"].as<std::string>();
+    }
+
+    if (vm.count("simd")) {
+        Fit::set_simd_level(vm["simd"].as<std::string>());
+    }
 }
 
 std::vector<std::string> split(const std::string &str, char delim = ':') {
@@ -199,20 +347,30 @@ int main(int argc, char *argv[]) {
 
     if (parameters.func_name == "sphere") {
         parameters.func = Fit::sphere;
+        parameters.func_ptr = Fit::sphere_ptr;
+        parameters.func_batch = Fit::sphere_batch;
     } else if (parameters.func_name == "rastrigin") {
         parameters.func = Fit::rastrigin;
+        parameters.func_ptr = Fit::rastrigin_ptr;
+        parameters.func_batch = Fit::rastrigin_batch;
     } else if (parameters.func_name == "flipflop") {
         parameters.func = Fit::flipflop;
+        parameters.func_ptr = Fit::flipflop_ptr;
+        parameters.func_batch = Fit::flipflop_batch;
     }
 
     if (parameters.dx_name == "sphere_dx") {
         parameters.dx = Fit::sphere_dx;
+        parameters.dx_ptr = Fit::sphere_dx_ptr;
     }
 
     try {
+        Fit::catch_signals();
         Fit::Optimization og(parameters);
         Fit::Result result = og.optimize();
         result.print();
+        if (result.interrupted)
+            return 128 + Fit::interrupted();
     } catch (const std::invalid_argument &e) {
         std::cerr << "Error with command line arguments: " << e.what() << "\n";
         std::cerr << "Try:\n" << argv[0] << " -h\n" << "for help.\n";
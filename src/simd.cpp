@@ -0,0 +1,543 @@
+/**
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ *  more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Kernels for the built-in test functions. Each instruction set gets its own
+// copy of the kernels, compiled with a target attribute so the rest of the
+// library doesn't need any special flags, and the best copy the CPU supports
+// is picked the first time one is called.
+
+#include "fit.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FIT_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// The kernels for one instruction set.
+struct kernels {
+  const char *name;
+  double (*sphere)(const double *x, size_t n);
+  void (*sphere_dx)(const double *x, size_t n, double *dx);
+  double (*rastrigin)(const double *x, size_t n);
+  double (*flipflop)(const double *x, size_t n);
+  void (*sphere_batch)(const double *xs, size_t m, size_t n, double *ys);
+  void (*rastrigin_batch)(const double *xs, size_t m, size_t n, double *ys);
+  void (*flipflop_batch)(const double *xs, size_t m, size_t n, double *ys);
+};
+
+// Plain C++, and the reference the others are tested against.
+
+double sphere_scalar(const double *x, size_t n) {
+  double total = 0.0;
+  for (size_t i = 0; i < n; i++)
+    total += x[i] * x[i];
+  return total;
+}
+
+void sphere_dx_scalar(const double *x, size_t n, double *dx) {
+  for (size_t i = 0; i < n; i++) {
+    dx[i] = 2 * x[i];
+  }
+}
+
+double rastrigin_scalar(const double *x, size_t n) {
+  double total = 10 * n;
+  for (size_t i = 0; i < n; i++) {
+    double term = (10.0 + x[i]) * (10.0 + x[i]) -
+                  10.0 * std::cos(2 * M_PI * (x[i] + 10.0));
+    total += term;
+  }
+  return total;
+}
+
+double flipflop_scalar(const double *x, size_t n) {
+  double total = 15.0;
+  for (size_t i = 0; i < n; i++) {
+    total += x[i];
+  }
+  return fabs(total);
+}
+
+template <double (*F)(const double *, size_t)>
+void rows(const double *xs, size_t m, size_t n, double *ys) {
+  for (size_t i = 0; i < m; i++)
+    ys[i] = F(xs + i * n, n);
+}
+
+const kernels scalar_kernels = {
+    "scalar",
+    sphere_scalar,
+    sphere_dx_scalar,
+    rastrigin_scalar,
+    flipflop_scalar,
+    rows<sphere_scalar>,
+    rows<rastrigin_scalar>,
+    rows<flipflop_scalar>,
+};
+
+#ifdef FIT_X86_KERNELS
+
+// Rastrigin needs cos(2 pi t) for t = x + 10, and there is no vector cos.
+// Taking the nearest integer off t first is exact, and leaves r in
+// [-1/2, 1/2]. cos is even and cos(2 pi r) = -cos(2 pi (1/2 - r)), which
+// brings the argument down to [0, pi/2], where the Taylor series to z^20 is
+// good to about 1e-17. Without SSE4.1, |t| is rounded to the nearest integer
+// by adding and subtracting 2^52. That only works below 2^52, but from there
+// on every double is an integer already, so those lanes are left as they
+// are. Rounding |t| rather than t is fine as cos is even.
+const double round_magic = 4503599627370496.0;
+const double cos_coefficients[] = {
+    1.0 / 2432902008176640000.0,  // 1/20!
+    -1.0 / 6402373705728000.0,    // 1/18!
+    1.0 / 20922789888000.0,       // 1/16!
+    -1.0 / 87178291200.0,         // 1/14!
+    1.0 / 479001600.0,            // 1/12!
+    -1.0 / 3628800.0,             // 1/10!
+    1.0 / 40320.0,                // 1/8!
+    -1.0 / 720.0,                 // 1/6!
+    1.0 / 24.0,                   // 1/4!
+    -1.0 / 2.0,                   // 1/2!
+    1.0,
+};
+
+// SSE2, which every x86-64 CPU has.
+
+double hsum(__m128d v) {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+double sphere_sse2(const double *x, size_t n) {
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(a, a));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(b, b));
+  }
+  double total = hsum(_mm_add_pd(acc0, acc1));
+  for (; i < n; i++)
+    total += x[i] * x[i];
+  return total;
+}
+
+void sphere_dx_sse2(const double *x, size_t n, double *dx) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(x + i);
+    _mm_storeu_pd(dx + i, _mm_add_pd(a, a));
+  }
+  for (; i < n; i++)
+    dx[i] = 2 * x[i];
+}
+
+__m128d cos_2pi_sse2(__m128d t) {
+  const __m128d magic = _mm_set1_pd(round_magic);
+  const __m128d sign = _mm_set1_pd(-0.0);
+  __m128d u = _mm_andnot_pd(sign, t);
+  __m128d whole = _mm_cmpge_pd(u, magic);
+  __m128d n = _mm_sub_pd(_mm_add_pd(u, magic), magic);
+  n = _mm_or_pd(_mm_and_pd(whole, u), _mm_andnot_pd(whole, n));
+  __m128d a = _mm_andnot_pd(sign, _mm_sub_pd(u, n));
+  __m128d far = _mm_cmpgt_pd(a, _mm_set1_pd(0.25));
+  a = _mm_or_pd(_mm_andnot_pd(far, a),
+                _mm_and_pd(far, _mm_sub_pd(_mm_set1_pd(0.5), a)));
+  __m128d z = _mm_mul_pd(a, _mm_set1_pd(2 * M_PI));
+  __m128d z2 = _mm_mul_pd(z, z);
+  __m128d c = _mm_set1_pd(cos_coefficients[0]);
+  for (size_t k = 1; k < sizeof cos_coefficients / sizeof(double); k++)
+    c = _mm_add_pd(_mm_mul_pd(c, z2), _mm_set1_pd(cos_coefficients[k]));
+  return _mm_xor_pd(c, _mm_and_pd(far, sign));
+}
+
+double rastrigin_sse2(const double *x, size_t n) {
+  const __m128d ten = _mm_set1_pd(10.0);
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d t = _mm_add_pd(_mm_loadu_pd(x + i), ten);
+    __m128d term =
+        _mm_sub_pd(_mm_mul_pd(t, t), _mm_mul_pd(ten, cos_2pi_sse2(t)));
+    acc = _mm_add_pd(acc, term);
+  }
+  double total = 10 * n + hsum(acc);
+  if (i < n) {
+    __m128d t = _mm_add_sd(_mm_load_sd(x + i), ten);
+    double c = _mm_cvtsd_f64(cos_2pi_sse2(t));
+    double v = x[i] + 10.0;
+    total += v * v - 10.0 * c;
+  }
+  return total;
+}
+
+double flipflop_sse2(const double *x, size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2)
+    acc = _mm_add_pd(acc, _mm_loadu_pd(x + i));
+  double total = 15.0 + hsum(acc);
+  for (; i < n; i++)
+    total += x[i];
+  return fabs(total);
+}
+
+const kernels sse2_kernels = {
+    "sse2",
+    sphere_sse2,
+    sphere_dx_sse2,
+    rastrigin_sse2,
+    flipflop_sse2,
+    rows<sphere_sse2>,
+    rows<rastrigin_sse2>,
+    rows<flipflop_sse2>,
+};
+
+// AVX2 with FMA. The batched kernels put one candidate in each lane and
+// walk along the rows, which suits the short vectors most optimizations use
+// better than vectorising within a row.
+
+#define FIT_AVX2 __attribute__((target("avx2,fma")))
+
+FIT_AVX2 double hsum(__m256d v) {
+  __m128d lo = _mm256_castpd256_pd128(v), hi = _mm256_extractf128_pd(v, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+// Lanes i < k are set.
+FIT_AVX2 __m256i lanes_avx2(size_t k) {
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x(k),
+                            _mm256_setr_epi64x(0, 1, 2, 3));
+}
+
+FIT_AVX2 __m256d cos_2pi_avx2(__m256d t) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d r = _mm256_sub_pd(
+      t, _mm256_round_pd(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  __m256d a = _mm256_andnot_pd(sign, r);
+  __m256d far = _mm256_cmp_pd(a, _mm256_set1_pd(0.25), _CMP_GT_OQ);
+  a = _mm256_blendv_pd(a, _mm256_sub_pd(_mm256_set1_pd(0.5), a), far);
+  __m256d z = _mm256_mul_pd(a, _mm256_set1_pd(2 * M_PI));
+  __m256d z2 = _mm256_mul_pd(z, z);
+  __m256d c = _mm256_set1_pd(cos_coefficients[0]);
+  for (size_t k = 1; k < sizeof cos_coefficients / sizeof(double); k++)
+    c = _mm256_fmadd_pd(c, z2, _mm256_set1_pd(cos_coefficients[k]));
+  return _mm256_xor_pd(c, _mm256_and_pd(far, sign));
+}
+
+FIT_AVX2 __m256d rastrigin_term_avx2(__m256d x) {
+  const __m256d ten = _mm256_set1_pd(10.0);
+  __m256d t = _mm256_add_pd(x, ten);
+  return _mm256_fmsub_pd(t, t, _mm256_mul_pd(ten, cos_2pi_avx2(t)));
+}
+
+FIT_AVX2 double sphere_avx2(const double *x, size_t n) {
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+    acc0 = _mm256_fmadd_pd(a, a, acc0);
+    acc1 = _mm256_fmadd_pd(b, b, acc1);
+  }
+  if (i < n) {
+    __m256i mask = lanes_avx2(n - i);
+    __m256d a = _mm256_maskload_pd(x + i, mask);
+    acc0 = _mm256_fmadd_pd(a, a, acc0);
+    if (n - i > 4) {
+      __m256d b = _mm256_maskload_pd(x + i + 4, lanes_avx2(n - i - 4));
+      acc1 = _mm256_fmadd_pd(b, b, acc1);
+    }
+  }
+  return hsum(_mm256_add_pd(acc0, acc1));
+}
+
+FIT_AVX2 void sphere_dx_avx2(const double *x, size_t n, double *dx) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x + i);
+    _mm256_storeu_pd(dx + i, _mm256_add_pd(a, a));
+  }
+  if (i < n) {
+    __m256i mask = lanes_avx2(n - i);
+    __m256d a = _mm256_maskload_pd(x + i, mask);
+    _mm256_maskstore_pd(dx + i, mask, _mm256_add_pd(a, a));
+  }
+}
+
+FIT_AVX2 double rastrigin_avx2(const double *x, size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_add_pd(acc, rastrigin_term_avx2(_mm256_loadu_pd(x + i)));
+  if (i < n) {
+    __m256i mask = lanes_avx2(n - i);
+    __m256d term = rastrigin_term_avx2(_mm256_maskload_pd(x + i, mask));
+    acc = _mm256_add_pd(acc, _mm256_and_pd(term, _mm256_castsi256_pd(mask)));
+  }
+  return 10 * n + hsum(acc);
+}
+
+FIT_AVX2 double flipflop_avx2(const double *x, size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    acc = _mm256_add_pd(acc, _mm256_loadu_pd(x + i));
+  if (i < n)
+    acc = _mm256_add_pd(acc, _mm256_maskload_pd(x + i, lanes_avx2(n - i)));
+  return fabs(15.0 + hsum(acc));
+}
+
+// The same variable in four consecutive rows. Loading the values one at a
+// time is quicker than vgatherqpd on the CPUs we tried, some of which have
+// microcode that makes gathers very slow.
+FIT_AVX2 __m256d column_avx2(const double *x, size_t n) {
+  return _mm256_setr_pd(x[0], x[n], x[2 * n], x[3 * n]);
+}
+
+FIT_AVX2 void sphere_batch_avx2(const double *xs, size_t m, size_t n,
+                                double *ys) {
+  size_t i = 0;
+  for (; i + 4 <= m; i += 4) {
+    const double *base = xs + i * n;
+    __m256d acc = _mm256_setzero_pd();
+    for (size_t j = 0; j < n; j++) {
+      __m256d v = column_avx2(base + j, n);
+      acc = _mm256_fmadd_pd(v, v, acc);
+    }
+    _mm256_storeu_pd(ys + i, acc);
+  }
+  for (; i < m; i++)
+    ys[i] = sphere_avx2(xs + i * n, n);
+}
+
+FIT_AVX2 void rastrigin_batch_avx2(const double *xs, size_t m, size_t n,
+                                   double *ys) {
+  size_t i = 0;
+  for (; i + 4 <= m; i += 4) {
+    const double *base = xs + i * n;
+    __m256d acc = _mm256_set1_pd(10.0 * n);
+    for (size_t j = 0; j < n; j++)
+      acc = _mm256_add_pd(acc, rastrigin_term_avx2(column_avx2(base + j, n)));
+    _mm256_storeu_pd(ys + i, acc);
+  }
+  for (; i < m; i++)
+    ys[i] = rastrigin_avx2(xs + i * n, n);
+}
+
+FIT_AVX2 void flipflop_batch_avx2(const double *xs, size_t m, size_t n,
+                                  double *ys) {
+  size_t i = 0;
+  for (; i + 4 <= m; i += 4) {
+    const double *base = xs + i * n;
+    __m256d acc = _mm256_set1_pd(15.0);
+    for (size_t j = 0; j < n; j++)
+      acc = _mm256_add_pd(acc, column_avx2(base + j, n));
+    _mm256_storeu_pd(ys + i, _mm256_andnot_pd(_mm256_set1_pd(-0.0), acc));
+  }
+  for (; i < m; i++)
+    ys[i] = flipflop_avx2(xs + i * n, n);
+}
+
+const kernels avx2_kernels = {
+    "avx2",
+    sphere_avx2,
+    sphere_dx_avx2,
+    rastrigin_avx2,
+    flipflop_avx2,
+    sphere_batch_avx2,
+    rastrigin_batch_avx2,
+    flipflop_batch_avx2,
+};
+
+// AVX-512F, for batches only. A single point rarely fills more than a
+// couple of 512 bit registers, and on the machines we measured each call
+// into 512 bit code cost more than the wider registers saved, so the single
+// point kernels are the AVX2 ones.
+
+#define FIT_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+FIT_AVX512 __m512d column_avx512(const double *x, size_t n) {
+  return _mm512_setr_pd(x[0], x[n], x[2 * n], x[3 * n], x[4 * n], x[5 * n],
+                        x[6 * n], x[7 * n]);
+}
+
+FIT_AVX512 __m512d cos_2pi_avx512(__m512d t) {
+  // The unmasked roundscale starts from an undefined vector, which GCC 12
+  // warns about, so this passes a zero one.
+  __m512d r = _mm512_sub_pd(
+      t, _mm512_mask_roundscale_pd(_mm512_setzero_pd(), 0xff, t,
+                                   _MM_FROUND_TO_NEAREST_INT |
+                                       _MM_FROUND_NO_EXC));
+  __m512d a = _mm512_abs_pd(r);
+  __mmask8 far = _mm512_cmp_pd_mask(a, _mm512_set1_pd(0.25), _CMP_GT_OQ);
+  a = _mm512_mask_sub_pd(a, far, _mm512_set1_pd(0.5), a);
+  __m512d z = _mm512_mul_pd(a, _mm512_set1_pd(2 * M_PI));
+  __m512d z2 = _mm512_mul_pd(z, z);
+  __m512d c = _mm512_set1_pd(cos_coefficients[0]);
+  for (size_t k = 1; k < sizeof cos_coefficients / sizeof(double); k++)
+    c = _mm512_fmadd_pd(c, z2, _mm512_set1_pd(cos_coefficients[k]));
+  return _mm512_mask_sub_pd(c, far, _mm512_setzero_pd(), c);
+}
+
+FIT_AVX512 __m512d rastrigin_term_avx512(__m512d x) {
+  const __m512d ten = _mm512_set1_pd(10.0);
+  __m512d t = _mm512_add_pd(x, ten);
+  return _mm512_fmsub_pd(t, t, _mm512_mul_pd(ten, cos_2pi_avx512(t)));
+}
+
+FIT_AVX512 void sphere_batch_avx512(const double *xs, size_t m, size_t n,
+                                    double *ys) {
+  size_t i = 0;
+  for (; i + 8 <= m; i += 8) {
+    const double *base = xs + i * n;
+    __m512d acc = _mm512_setzero_pd();
+    for (size_t j = 0; j < n; j++) {
+      __m512d v = column_avx512(base + j, n);
+      acc = _mm512_fmadd_pd(v, v, acc);
+    }
+    _mm512_storeu_pd(ys + i, acc);
+  }
+  sphere_batch_avx2(xs + i * n, m - i, n, ys + i);
+}
+
+FIT_AVX512 void rastrigin_batch_avx512(const double *xs, size_t m, size_t n,
+                                       double *ys) {
+  size_t i = 0;
+  for (; i + 8 <= m; i += 8) {
+    const double *base = xs + i * n;
+    __m512d acc = _mm512_set1_pd(10.0 * n);
+    for (size_t j = 0; j < n; j++) {
+      __m512d v = column_avx512(base + j, n);
+      acc = _mm512_add_pd(acc, rastrigin_term_avx512(v));
+    }
+    _mm512_storeu_pd(ys + i, acc);
+  }
+  rastrigin_batch_avx2(xs + i * n, m - i, n, ys + i);
+}
+
+FIT_AVX512 void flipflop_batch_avx512(const double *xs, size_t m, size_t n,
+                                      double *ys) {
+  size_t i = 0;
+  for (; i + 8 <= m; i += 8) {
+    const double *base = xs + i * n;
+    __m512d acc = _mm512_set1_pd(15.0);
+    for (size_t j = 0; j < n; j++)
+      acc = _mm512_add_pd(acc, column_avx512(base + j, n));
+    _mm512_storeu_pd(ys + i, _mm512_abs_pd(acc));
+  }
+  flipflop_batch_avx2(xs + i * n, m - i, n, ys + i);
+}
+
+const kernels avx512_kernels = {
+    "avx512",
+    sphere_avx2,
+    sphere_dx_avx2,
+    rastrigin_avx2,
+    flipflop_avx2,
+    sphere_batch_avx512,
+    rastrigin_batch_avx512,
+    flipflop_batch_avx512,
+};
+
+#endif
+
+// The kernel sets this CPU can run, slowest first.
+std::vector<const kernels *> supported() {
+  std::vector<const kernels *> result = {&scalar_kernels};
+#ifdef FIT_X86_KERNELS
+  __builtin_cpu_init();
+  result.push_back(&sse2_kernels);
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    result.push_back(&avx2_kernels);
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma"))
+    result.push_back(&avx512_kernels);
+#endif
+  return result;
+}
+
+const std::vector<const kernels *> &available() {
+  static const std::vector<const kernels *> sets = supported();
+  return sets;
+}
+
+std::atomic<const kernels *> &active() {
+  static std::atomic<const kernels *> set(available().back());
+  return set;
+}
+
+const kernels &use() { return *active().load(std::memory_order_relaxed); }
+
+} // namespace
+
+namespace Fit {
+
+double sphere_ptr(const double *x, size_t n) { return use().sphere(x, n); }
+
+void sphere_dx_ptr(const double *x, size_t n, double *dx) {
+  use().sphere_dx(x, n, dx);
+}
+
+double rastrigin_ptr(const double *x, size_t n) {
+  return use().rastrigin(x, n);
+}
+
+double flipflop_ptr(const double *x, size_t n) { return use().flipflop(x, n); }
+
+void sphere_batch(const double *xs, size_t m, size_t n, double *ys) {
+  use().sphere_batch(xs, m, n, ys);
+}
+
+// The gradient is elementwise, so a batch is one long vector.
+void sphere_dx_batch(const double *xs, size_t m, size_t n, double *dxs) {
+  use().sphere_dx(xs, m * n, dxs);
+}
+
+void rastrigin_batch(const double *xs, size_t m, size_t n, double *ys) {
+  use().rastrigin_batch(xs, m, n, ys);
+}
+
+void flipflop_batch(const double *xs, size_t m, size_t n, double *ys) {
+  use().flipflop_batch(xs, m, n, ys);
+}
+
+std::string simd_level() { return use().name; }
+
+std::vector<std::string> simd_levels() {
+  std::vector<std::string> result;
+  for (const kernels *k : available())
+    result.push_back(k->name);
+  return result;
+}
+
+void set_simd_level(const std::string &level) {
+  for (const kernels *k : available()) {
+    if (level == k->name) {
+      active().store(k);
+      return;
+    }
+  }
+  throw std::invalid_argument("SIMD level " + level +
+                              " is not supported on this CPU");
+}
+
+} // namespace Fit
@@ -3,6 +3,8 @@
 #include <errno.h>
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
+#include "fit_protocol.h"
+#include "fit_shm.h"
 
 double sphere(const double x[], size_t n)
 {
@@ -12,11 +14,79 @@ double sphere(const double x[], size_t n)
         return total;
 }
 
+/* With no arguments, read one vector per line from stdin and reply to each
+ * with one line on stdout. This is how fit drives an external-persistent
+ * model. If crash_after is not negative, exit without replying to the
+ * request after that many, as a model that crashes would. */
+static void stream(long crash_after)
+{
+        char *line = NULL;
+        size_t cap = 0;
+        double *x = NULL;
+
+        for (long requests = 0; getline(&line, &cap, stdin) != -1; requests++) {
+                if (requests == crash_after)
+                        exit(EXIT_FAILURE);
+                char *p = line, *end;
+                arrsetlen(x, 0);
+                for (double d = strtod(p, &end); end != p; d = strtod(p, &end)) {
+                        arrput(x, d);
+                        p = end;
+                }
+                printf("%.17g\n", sphere(x, arrlen(x)));
+                fflush(stdout);
+        }
+        free(line);
+        arrfree(x);
+}
+
+/* The same as stream() but vectors and replies are binary frames. */
+static void binary(void)
+{
+        double *x = NULL;
+        size_t cap = 0;
+        long n;
+        while ((n = fit_read_frame(stdin, &x, &cap)) >= 0) {
+                double y = sphere(x, n);
+                fit_write_frame(stdout, &y, 1);
+        }
+        free(x);
+}
+
+/* The same as stream() but through the shared memory ring set up by fit. */
+static void shared(void)
+{
+        struct fit_shm shm;
+        if (fit_shm_attach(&shm) != 0) {
+                fprintf(stderr, "Can't attach to fit's shared memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        const double *x;
+        long n;
+        while ((n = fit_shm_next(&shm, &x)) >= 0) {
+                double y = sphere(x, n);
+                fit_shm_reply(&shm, &y, 1);
+        }
+        fit_shm_detach(&shm);
+}
+
 int main(int argc, char *argv[])
 {
         if (argc < 2) {
-                fprintf(stderr, "Must have at least one argument.\n");
-                exit(EXIT_FAILURE);
+                stream(-1);
+                return 0;
+        }
+        if (strcmp(argv[1], "--crash-after") == 0 && argc > 2) {
+                stream(atol(argv[2]));
+                return 0;
+        }
+        if (strcmp(argv[1], "--binary") == 0) {
+                binary();
+                return 0;
+        }
+        if (strcmp(argv[1], "--shm") == 0) {
+                shared();
+                return 0;
         }
         int n = argc - 1;
         double *x = NULL;
@@ -27,6 +97,6 @@ int main(int argc, char *argv[])
         }
         for (int i = 0; i < n; i++)
                 x[i] = atof(argv[i + 1]);
-        printf("%f\n", sphere(x, n));
+        printf("%.17g\n", sphere(x, n));
         arrfree(x);
 }
@@ -6,6 +6,8 @@
 #include <errno.h>
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
+#include "fit_protocol.h"
+#include "fit_shm.h"
 
 void sphere_dx(const double x[], size_t n, double dx[])
 {
@@ -14,11 +16,83 @@ void sphere_dx(const double x[], size_t n, double dx[])
         }
 }
 
+/* With no arguments, read one vector per line from stdin and reply to each
+ * with one line on stdout. This is how fit drives an external-persistent
+ * model. */
+static void stream(void)
+{
+        char *line = NULL;
+        size_t cap = 0;
+        double *x = NULL;
+        double *dx = NULL;
+        while (getline(&line, &cap, stdin) != -1) {
+                char *p = line, *end;
+                arrsetlen(x, 0);
+                for (double d = strtod(p, &end); end != p; d = strtod(p, &end)) {
+                        arrput(x, d);
+                        p = end;
+                }
+                arrsetlen(dx, arrlen(x));
+                sphere_dx(x, arrlen(x), dx);
+                for (ptrdiff_t i = 0; i < arrlen(dx); i++)
+                        printf("%.17g ", dx[i]);
+                printf("\n");
+                fflush(stdout);
+        }
+        free(line);
+        arrfree(x);
+        arrfree(dx);
+}
+
+/* The same as stream() but vectors and replies are binary frames. */
+static void binary(void)
+{
+        double *x = NULL;
+        double *dx = NULL;
+        size_t cap = 0;
+        long n;
+        while ((n = fit_read_frame(stdin, &x, &cap)) >= 0) {
+                arrsetlen(dx, n);
+                sphere_dx(x, n, dx);
+                fit_write_frame(stdout, dx, n);
+        }
+        free(x);
+        arrfree(dx);
+}
+
+/* The same as stream() but through the shared memory ring set up by fit. */
+static void shared(void)
+{
+        struct fit_shm shm;
+        if (fit_shm_attach(&shm) != 0) {
+                fprintf(stderr, "Can't attach to fit's shared memory.\n");
+                exit(EXIT_FAILURE);
+        }
+        const double *x;
+        long n;
+        double *dx = NULL;
+        while ((n = fit_shm_next(&shm, &x)) >= 0) {
+                arrsetlen(dx, n);
+                sphere_dx(x, n, dx);
+                fit_shm_reply(&shm, dx, n);
+        }
+        fit_shm_detach(&shm);
+        arrfree(dx);
+}
+
 int main(int argc, char *argv[])
 {
         if (argc < 2) {
-                fprintf(stderr, "Must have at least one argument.\n");
-                exit(EXIT_FAILURE);
+                stream();
+                return 0;
+        }
+        if (strcmp(argv[1], "--binary") == 0) {
+                binary();
+                return 0;
+        }
+        if (strcmp(argv[1], "--shm") == 0) {
+                shared();
+                return 0;
         }
         int n = argc - 1;
         double *x = NULL;
@@ -35,7 +109,7 @@ int main(int argc, char *argv[])
         arrsetlen(dx, n);
         sphere_dx(x, n, dx);
         for (size_t i = 0; i < n; i++)
-                printf("%f ", dx[i]);
+                printf("%.17g ", dx[i]);
         printf("\n");
         arrfree(x);
         arrfree(dx);
@@ -0,0 +1,36 @@
+/*
+ * The sphere function and its gradient as a fit plugin. For test purposes
+ * only. The context is just a scale factor, to exercise the init and teardown
+ * hooks.
+ */
+#include <stdlib.h>
+#include "fit_plugin.h"
+
+void *sphere_init(size_t n)
+{
+        (void) n;
+        double *scale = malloc(sizeof *scale);
+        if (scale)
+                *scale = 1.0;
+        return scale;
+}
+
+void sphere_teardown(void *ctx)
+{
+        free(ctx);
+}
+
+double sphere(size_t n, const double *x, void *ctx)
+{
+        double total = 0.0;
+        for (size_t i = 0; i < n; i++)
+                total += x[i] * x[i];
+        return *(double *) ctx * total;
+}
+
+void sphere_dx(size_t n, const double *x, double *dx, void *ctx)
+{
+        (void) ctx;
+        for (size_t i = 0; i < n; i++)
+                dx[i] = 2 * x[i];
+}
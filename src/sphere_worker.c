@@ -0,0 +1,34 @@
+/*
+ * The sphere function behind fit_worker.h. For test purposes only. The model
+ * counts its evaluations in a global and adds the count minus one to the
+ * result, so it only returns the sphere function if every evaluation starts
+ * from the state left by init.
+ */
+#include <stdlib.h>
+#include "fit_worker.h"
+
+static long evaluations;
+
+static void *init(int argc, char *argv[])
+{
+        (void) argc;
+        (void) argv;
+        evaluations = 0;
+        return NULL;
+}
+
+static long eval(void *ctx, const double *x, long n, double *y)
+{
+        (void) ctx;
+        double total = 0.0;
+        for (long i = 0; i < n; i++)
+                total += x[i] * x[i];
+        y[0] = total + evaluations++;
+        return 1;
+}
+
+int main(int argc, char *argv[])
+{
+        struct fit_worker_model model = {init, eval};
+        return fit_worker_main(argc, argv, &model);
+}
@@ -2,6 +2,13 @@
 #include <boost/test/included/unit_test.hpp>
 #include <boost/process.hpp>
 #include "fit.hpp"
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <set>
+#include <unistd.h>
 
 namespace bp = boost::process;
 
@@ -21,6 +28,9 @@ static std::string find_prog(const char *prog)
 
 std::string sphere_prog = find_prog("fit_sphere");
 std::string sphere_dx_prog = find_prog("fit_sphere_dx");
+std::string sphere_worker_prog = find_prog("fit_sphere_worker");
+std::string sphere_plugin =
+    getenv("FIT_SPHERE_PLUGIN") ? getenv("FIT_SPHERE_PLUGIN") : "";
 
 BOOST_AUTO_TEST_CASE(test_default_parameters) {
     try {
@@ -78,6 +88,8 @@ BOOST_AUTO_TEST_CASE(test_random_external_sphere) {
         BOOST_TEST(result.lowest >= 0.0);
         BOOST_TEST(result.best.size() == 10);
         BOOST_TEST(result.calls == 100);
+        BOOST_TEST(result.spawns == 100);
+        BOOST_TEST(result.spawn_latency > 0.0);
     } else {
         std::cerr << "Warning: sphere test program not found.\n";
     }
@@ -241,3 +253,1611 @@ BOOST_AUTO_TEST_CASE(test_gradient_external_sphere) {
         std::cerr << "Warning: sphere test program or sphere dx test program not found.\n";
     }
 }
+
+BOOST_AUTO_TEST_CASE(test_grid_external_persistent_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "grid";
+        parameters.func_name = "external-persistent";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest <= 1000000.0);
+        BOOST_TEST(result.lowest >= 0.0);
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls > 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_external_persistent_pool) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "grid";
+        parameters.func_name = "external-persistent";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.threads = 4;
+        parameters.workers = 2;
+        parameters.passes = 8;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest <= 1000000.0);
+        BOOST_TEST(result.lowest >= 0.0);
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls > 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_external_persistent_restart) {
+    if (sphere_prog > "") {
+        // Each model process exits on its fourth request, so the pool has
+        // to restart it and resend that vector every few evaluations.
+        std::string command = sphere_prog + " --crash-after 3";
+        Fit::external_persistent e(command, 2);
+        bool right = true;
+        for (unsigned i = 0; i < 20; i++) {
+            std::vector<double> x = {(double)i, 0.5, -2.0};
+            right = right && e(x) == Fit::sphere(x);
+        }
+        BOOST_TEST(right);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_external_persistent_bad_replies) {
+    // A reply that isn't a number is an error, not a value.
+    std::string garbage = "sh -c \"while read x; do echo oops; done\"";
+    Fit::external_persistent e(garbage);
+    BOOST_CHECK_THROW(e({1.0, 2.0}), std::runtime_error);
+    // Writing to a model that has exited fails without SIGPIPE, and fit
+    // leaves the disposition of the signal alone.
+    std::string dead = "true";
+    Fit::external_persistent d(dead);
+    BOOST_CHECK_THROW(d({1.0, 2.0}), std::runtime_error);
+    struct sigaction action;
+    sigaction(SIGPIPE, nullptr, &action);
+    BOOST_TEST((action.sa_handler == SIG_DFL));
+}
+
+BOOST_AUTO_TEST_CASE(test_gradient_external_persistent_sphere) {
+    if (sphere_prog > "" && sphere_dx_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "gradient";
+        parameters.func_name = "external-persistent";
+        parameters.dx_name = "external-persistent";
+        parameters.command = sphere_prog;
+        parameters.command_dx = sphere_dx_prog;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest <= 1000000.0);
+        BOOST_TEST(result.lowest >= 0.0);
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls < 50);
+    } else {
+        std::cerr << "Warning: sphere test program or sphere dx test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_frame_round_trip) {
+    std::vector<double> v = {0.1, -1e-300, 123456789.123456789,
+                             std::nextafter(1.0, 2.0), 0.0};
+    std::stringstream ss;
+    Fit::write_frame(ss, v);
+    Fit::write_frame(ss, {});
+    BOOST_TEST(ss.str().size() == 4 + 8 * v.size() + 4);
+    std::vector<double> w;
+    BOOST_TEST(Fit::read_frame(ss, w));
+    BOOST_TEST(w == v);
+    BOOST_TEST(Fit::read_frame(ss, w));
+    BOOST_TEST(w.empty());
+    BOOST_TEST(!Fit::read_frame(ss, w));
+    // A count beyond the limit is refused before anything is allocated.
+    std::stringstream big;
+    Fit::write_frame(big, v);
+    BOOST_TEST(!Fit::read_frame(big, w, v.size() - 1));
+    std::stringstream corrupt(std::string("\xff\xff\xff\xff", 4));
+    BOOST_TEST(!Fit::read_frame(corrupt, w));
+}
+
+BOOST_AUTO_TEST_CASE(test_random_external_binary_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "random";
+        parameters.func_name = "external";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog + " --binary";
+        parameters.protocol = "binary";
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls == 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_gradient_external_persistent_binary_sphere) {
+    if (sphere_prog > "" && sphere_dx_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "gradient";
+        parameters.func_name = "external-persistent";
+        parameters.dx_name = "external-persistent";
+        parameters.command = sphere_prog + " --binary";
+        parameters.command_dx = sphere_dx_prog + " --binary";
+        parameters.protocol = "binary";
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest <= 1000000.0);
+        BOOST_TEST(result.lowest >= 0.0);
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls < 50);
+    } else {
+        std::cerr << "Warning: sphere test program or sphere dx test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_gradient_plugin_sphere) {
+    if (sphere_plugin > "") {
+        Fit::Parameters parameters;
+        parameters.method = "gradient";
+        parameters.func_name = "plugin:" + sphere_plugin + ":sphere";
+        parameters.dx_name = "plugin:" + sphere_plugin + ":sphere_dx";
+        parameters.command = "";
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls < 50);
+    } else {
+        std::cerr << "Warning: sphere test plugin not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_plugin_bad_spec) {
+    Fit::Parameters parameters;
+    parameters.func_name = "plugin:no-symbol";
+    BOOST_CHECK_THROW(Fit::Optimization fit(parameters), std::invalid_argument);
+    parameters.func_name = "plugin:/nonexistent/libmodel.so:model";
+    BOOST_CHECK_THROW(Fit::Optimization fit(parameters), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_external_shm_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "grid";
+        parameters.func_name = "external-shm";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog + " --shm";
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.threads = 4;
+        parameters.workers = 2;
+        parameters.passes = 8;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls > 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_external_shm_batch) {
+    if (sphere_prog > "") {
+        // More vectors than the ring has slots, so the batch is posted in
+        // several runs.
+        std::string command = sphere_prog + " --shm";
+        Fit::external_shm e(command, 3, 2);
+        std::vector<std::vector<double>> xs;
+        for (unsigned i = 0; i < 200; i++)
+            xs.push_back({(double)i, 1.0, -2.0});
+        auto values = e.evaluate(xs);
+        BOOST_TEST(values.size() == 200u);
+        bool right = true;
+        for (unsigned i = 0; i < values.size(); i++)
+            right = right && values[i] == Fit::sphere(xs[i]);
+        BOOST_TEST(right);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_gradient_external_shm_sphere) {
+    if (sphere_prog > "" && sphere_dx_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "gradient";
+        parameters.func_name = "external-shm";
+        parameters.dx_name = "external-shm";
+        parameters.command = sphere_prog + " --shm";
+        parameters.command_dx = sphere_dx_prog + " --shm";
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest <= 1000000.0);
+        BOOST_TEST(result.lowest >= 0.0);
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls < 50);
+    } else {
+        std::cerr << "Warning: sphere test program or sphere dx test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_random_external_async_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "random";
+        parameters.func_name = "external-async";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        parameters.in_flight = 16;
+        make_domains(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls == 100);
+        BOOST_TEST(result.spawns == 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_external_async_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "grid";
+        parameters.func_name = "external-async";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.threads = 2;
+        parameters.passes = 4;
+        parameters.in_flight = 16;
+        make_domains(parameters);
+        make_divisions(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls > 100);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_random_external_batch_sphere) {
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "random";
+        parameters.func_name = "external";
+        parameters.dx_name = "";
+        parameters.command = sphere_prog;
+        parameters.external_batch = 10;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        Fit::Optimization fit(parameters);
+        BOOST_TEST(bool(fit.parameters.func_batch));
+        auto result = fit.optimize();
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.best.size() == 10);
+        BOOST_TEST(result.calls == 100);
+        BOOST_TEST(result.spawns == 10);
+        // Without a batch size the programs are left to the pool's threads.
+        parameters.external_batch = 0;
+        BOOST_TEST(!Fit::Optimization(parameters).parameters.func_batch);
+    } else {
+        std::cerr << "Warning: sphere test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_external_batch_short_reply) {
+    // Both ways of running batches reject a reply with too few values.
+    std::string command = "sh -c \"cat > /dev/null; echo 1\"";
+    std::vector<std::vector<double>> xs = {{1.0}, {2.0}, {3.0}};
+    Fit::external e(command, "text", 3);
+    BOOST_CHECK_THROW(e.evaluate(xs), std::runtime_error);
+    Fit::external_async a(command, 2, "text", 3);
+    BOOST_CHECK_THROW(a.evaluate(xs), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_worker_sphere) {
+    if (sphere_worker_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "random";
+        parameters.func_name = "external-persistent";
+        parameters.dx_name = "";
+        parameters.command = sphere_worker_prog;
+        parameters.workers = 2;
+        parameters.variables = 10;
+        parameters.lo = {-100.0};
+        parameters.hi = {100.0};
+        parameters.domains = {};
+        parameters.error = 0.1;
+        parameters.verbose = false;
+        parameters.iterations = 100;
+        make_domains(parameters);
+        Fit::Optimization fit(parameters);
+        auto result = fit.optimize();
+        // The model drifts unless every evaluation gets a fresh fork.
+        BOOST_TEST(result.lowest == Fit::sphere(result.best),
+                   boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(result.calls == 100);
+    } else {
+        std::cerr << "Warning: sphere worker test program not found.\n";
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_random_external_timeout) {
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "external";
+    parameters.dx_name = "";
+    parameters.command = "sh -c \"sleep 10\"";
+    parameters.timeout = 0.1;
+    parameters.penalty = 1e6;
+    parameters.variables = 2;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.verbose = false;
+    parameters.iterations = 3;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == 1e6);
+    BOOST_TEST(result.calls == 3);
+    BOOST_TEST(result.timeouts == 3);
+}
+
+BOOST_AUTO_TEST_CASE(test_external_partial_reply_timeout) {
+    // The timeout covers the whole reply, not just its first byte.
+    Fit::eval_limits limits;
+    limits.timeout = 0.3;
+    limits.penalty = 1e6;
+    std::string partial = "sh -c \"printf 1; sleep 10\"";
+    Fit::external_persistent p(partial, 1, "text", limits);
+    auto started = std::chrono::steady_clock::now();
+    BOOST_TEST(p({1.0, 2.0}) == 1e6);
+    BOOST_TEST(p.stats().timeouts == 1u);
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - started;
+    BOOST_TEST(took.count() < 5.0);
+    // The shared memory ring can't time out a model, so it refuses to try.
+    if (sphere_prog > "") {
+        Fit::Parameters parameters;
+        parameters.method = "random";
+        parameters.func_name = "external-shm";
+        parameters.command = sphere_prog + " --shm";
+        parameters.variables = 2;
+        parameters.lo = {-1.0};
+        parameters.hi = {1.0};
+        parameters.domains = {};
+        parameters.iterations = 10;
+        parameters.timeout = 1.0;
+        parameters.verbose = false;
+        make_domains(parameters);
+        BOOST_CHECK_THROW(Fit::Optimization(parameters).optimize(),
+                          std::invalid_argument);
+        parameters.timeout = 0.0;
+        parameters.penalty = 1e6;
+        BOOST_CHECK_THROW(Fit::Optimization(parameters).optimize(),
+                          std::invalid_argument);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_external_failed_program) {
+    // Whatever a failed or killed program printed is not taken as a value.
+    std::string failed = "sh -c \"echo 1; exit 3\"";
+    Fit::external e(failed);
+    BOOST_CHECK_THROW(e({1.0, 2.0}), std::runtime_error);
+    std::string killed = "sh -c \"echo 1; kill -9 $$\"";
+    Fit::external k(killed);
+    BOOST_CHECK_THROW(k({1.0, 2.0}), std::runtime_error);
+    // external-async waits for the exit status too, even once stdout is
+    // closed, and times out a program that closes it and hangs.
+    Fit::external_async ea(failed, 2);
+    BOOST_CHECK_THROW(ea({1.0, 2.0}), std::runtime_error);
+    Fit::external_async ka(killed, 2);
+    BOOST_CHECK_THROW(ka({1.0, 2.0}), std::runtime_error);
+    std::string late = "sh -c \"echo 1; exec >&-; sleep 0.2; exit 3\"";
+    Fit::external_async la(late, 2);
+    BOOST_CHECK_THROW(la({1.0, 2.0}), std::runtime_error);
+    std::string hung = "sh -c \"echo 1; exec >&-; sleep 10\"";
+    Fit::eval_limits limits;
+    limits.timeout = 0.3;
+    limits.penalty = 1e6;
+    Fit::external_async ha(hung, 2, "text", 0, limits);
+    BOOST_TEST(ha({1.0, 2.0}) == 1e6);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_batch_sphere) {
+    std::atomic<size_t> largest(0);
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.dx_name = "";
+    parameters.func = NULL;
+    parameters.func_batch = [&largest](const double *xs, size_t m, size_t n,
+                                       double *ys) {
+        largest = std::max(largest.load(), m);
+        for (size_t i = 0; i < m; i++)
+            ys[i] = Fit::sphere_ptr(xs + i * n, n);
+    };
+    parameters.batch = 25;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.verbose = false;
+    parameters.iterations = 100;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    BOOST_TEST(result.calls == 100);
+    BOOST_TEST(largest == 25);
+}
+
+BOOST_AUTO_TEST_CASE(test_nms_batch_adapter_sphere) {
+    Fit::Parameters parameters;
+    parameters.method = "nms";
+    parameters.func_name = "sphere";
+    parameters.dx_name = "";
+    parameters.func = NULL;
+    parameters.func_batch = Fit::batch_adapter(Fit::sphere);
+    parameters.variables = 4;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.01;
+    parameters.verbose = false;
+    parameters.iterations = 1000;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest < 1.0);
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+}
+
+BOOST_AUTO_TEST_CASE(test_gradient_pointer_sphere) {
+    Fit::Parameters parameters;
+    parameters.method = "gradient";
+    parameters.func_name = "sphere";
+    parameters.dx_name = "sphere_dx";
+    parameters.func = NULL;
+    parameters.dx = NULL;
+    parameters.func_ptr = Fit::sphere_ptr;
+    parameters.dx_ptr = Fit::sphere_dx_ptr;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    BOOST_TEST(result.best.size() == 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_pointer_sphere) {
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.dx_name = "";
+    parameters.func = NULL;
+    parameters.func_ptr = Fit::sphere_ptr;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    BOOST_TEST(result.best.size() == 10);
+    BOOST_TEST(result.calls > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_basic_optimization_lambda) {
+    std::atomic<unsigned> calls(0);
+    auto sphere = [&calls](const double *x, size_t n) {
+        calls++;
+        return Fit::sphere_ptr(x, n);
+    };
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.iterations = 100;
+    make_domains(parameters);
+    Fit::basic_optimization<decltype(sphere)> fit(parameters, sphere);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    BOOST_TEST(result.calls == 100);
+    BOOST_TEST(calls == 100);
+}
+
+BOOST_AUTO_TEST_CASE(test_simd_kernels_match_scalar) {
+    std::uniform_real_distribution<double> dist(-100.0, 100.0);
+    std::vector<double> xs(11 * 19), ys(11), dxs(11 * 19);
+    for (auto &x : xs)
+        x = dist(Fit::random_engine());
+    Fit::set_simd_level("scalar");
+    std::vector<std::vector<double>> expected;
+    for (size_t n = 1; n <= 19; n++) {
+        std::vector<double> row(xs.begin(), xs.begin() + n);
+        expected.push_back({Fit::sphere(row), Fit::rastrigin(row),
+                            Fit::flipflop(row)});
+    }
+    auto levels = Fit::simd_levels();
+    BOOST_TEST(levels.front() == "scalar");
+    for (auto &level : levels) {
+        Fit::set_simd_level(level);
+        BOOST_TEST(Fit::simd_level() == level);
+        for (size_t n = 1; n <= 19; n++) {
+            auto want = expected[n - 1];
+            auto tolerance = boost::test_tools::tolerance(1e-12);
+            BOOST_TEST(Fit::sphere_ptr(xs.data(), n) == want[0], tolerance);
+            BOOST_TEST(Fit::rastrigin_ptr(xs.data(), n) == want[1], tolerance);
+            BOOST_TEST(Fit::flipflop_ptr(xs.data(), n) == want[2], tolerance);
+            // Every row of a batch against the single point kernel.
+            for (size_t m = 1; m * n <= xs.size() && m <= 11; m++) {
+                Fit::sphere_batch(xs.data(), m, n, ys.data());
+                for (size_t i = 0; i < m; i++)
+                    BOOST_TEST(ys[i] == Fit::sphere_ptr(&xs[i * n], n),
+                               tolerance);
+                Fit::rastrigin_batch(xs.data(), m, n, ys.data());
+                for (size_t i = 0; i < m; i++)
+                    BOOST_TEST(ys[i] == Fit::rastrigin_ptr(&xs[i * n], n),
+                               tolerance);
+                Fit::flipflop_batch(xs.data(), m, n, ys.data());
+                for (size_t i = 0; i < m; i++)
+                    BOOST_TEST(ys[i] == Fit::flipflop_ptr(&xs[i * n], n),
+                               tolerance);
+            }
+        }
+        Fit::sphere_dx_batch(xs.data(), 11, 19, dxs.data());
+        for (size_t i = 0; i < xs.size(); i++)
+            BOOST_TEST(dxs[i] == 2 * xs[i]);
+    }
+    Fit::set_simd_level(levels.back());
+    BOOST_CHECK_THROW(Fit::set_simd_level("mmx"), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_simd_batch_rastrigin) {
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "rastrigin";
+    parameters.func = Fit::rastrigin;
+    parameters.func_ptr = Fit::rastrigin_ptr;
+    parameters.func_batch = Fit::rastrigin_batch;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.iterations = 1000;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::rastrigin(result.best),
+               boost::test_tools::tolerance(1e-12));
+    BOOST_TEST(result.calls == 1000);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_batch_early_stop) {
+    // Every candidate is below error, so random search stops after the
+    // first batch: 64 evaluations for the built-in batch functions, or one
+    // with a batch of one.
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.func_batch = Fit::sphere_batch;
+    parameters.variables = 2;
+    parameters.lo = {-1.0};
+    parameters.hi = {1.0};
+    parameters.domains = {};
+    parameters.error = 10.0;
+    parameters.threads = 1;
+    parameters.iterations = 1000;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization batched(parameters);
+    BOOST_TEST(batched.optimize().calls == 64);
+    parameters.batch = 1;
+    Fit::Optimization single(parameters);
+    BOOST_TEST(single.optimize().calls == 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_error_reached_exactly) {
+    // A value equal to error stops every method that checks it, so -e 0
+    // with an exact hit behaves the same way for all of them.
+    for (std::string method : {"random", "grid"}) {
+        Fit::Parameters parameters;
+        parameters.method = method;
+        parameters.func_name = "zero";
+        parameters.func = NULL;
+        parameters.func_ptr = [](const double *, size_t) { return 0.0; };
+        parameters.variables = 2;
+        parameters.lo = {-1.0};
+        parameters.hi = {1.0};
+        parameters.domains = {};
+        parameters.threads = 1;
+        parameters.iterations = 1000;
+        parameters.verbose = false;
+        make_domains(parameters);
+        parameters.error = -1.0;
+        auto all = Fit::Optimization(parameters).optimize();
+        parameters.error = 0.0;
+        auto hit = Fit::Optimization(parameters).optimize();
+        BOOST_TEST_CONTEXT(method) {
+            BOOST_TEST(hit.lowest == 0.0);
+            BOOST_TEST(hit.calls < all.calls);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_pool) {
+    Fit::thread_pool pool(4);
+    BOOST_TEST(pool.size() == 4);
+    std::vector<std::atomic<unsigned>> counts(100);
+    pool.run(10, [&pool, &counts](size_t i) {
+        pool.run(10, [i, &counts](size_t j) { counts[i * 10 + j]++; });
+    });
+    for (auto &c : counts)
+        BOOST_TEST(c == 1);
+    BOOST_CHECK_THROW(pool.run(8,
+                               [](size_t i) {
+                                   if (i == 5)
+                                       throw std::runtime_error("task 5");
+                               }),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_thread_pool_steals) {
+    Fit::thread_pool pool(4);
+    const size_t tasks = 40;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t stolen = 0;
+    bool owner_waited = false;
+    // Only the first task has real work, in a nested run. The first of its
+    // tasks that the thread which started it picks up blocks until all the
+    // others are done, so they can only be done by other threads stealing
+    // them. The wait is bounded only so that a broken pool fails rather
+    // than hangs.
+    pool.run(4, [&](size_t i) {
+        if (i > 0)
+            return;
+        std::thread::id owner = std::this_thread::get_id();
+        bool blocked = false;
+        pool.run(tasks, [&](size_t) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (std::this_thread::get_id() == owner && !blocked) {
+                blocked = true;
+                owner_waited =
+                    changed.wait_for(lock, std::chrono::seconds(30), [&] {
+                        return stolen == tasks - 1;
+                    });
+                return;
+            }
+            if (std::this_thread::get_id() != owner)
+                stolen++;
+            changed.notify_all();
+        });
+    });
+    // If other threads took every task before the owner got to one, that
+    // was stealing too.
+    BOOST_TEST((owner_waited || stolen == tasks));
+    BOOST_TEST(stolen >= tasks - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_shared_pool) {
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.dx_name = "";
+    parameters.func = Fit::sphere;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.passes = 8;
+    parameters.threads = 4;
+    parameters.pool = std::make_shared<Fit::thread_pool>(4);
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto first = fit.optimize();
+    auto second = fit.optimize();
+    BOOST_TEST(first.lowest == Fit::sphere(first.best));
+    BOOST_TEST(second.lowest == Fit::sphere(second.best));
+    BOOST_TEST(second.calls > first.calls);
+}
+
+BOOST_AUTO_TEST_CASE(test_random_parallel_stop) {
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.threads = 4;
+    parameters.error = 0.1;
+    parameters.iterations = 10000;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization all(parameters);
+    auto result = all.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    BOOST_TEST(result.calls == 10000);
+    // Every point is within this error, so the threads stop after the
+    // chunks they have already claimed.
+    parameters.error = 1e9;
+    parameters.iterations = 1000000;
+    Fit::Optimization first(parameters);
+    result = first.optimize();
+    BOOST_TEST(result.lowest < 1e9);
+    BOOST_TEST(result.calls <= 4 * 256);
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_shared_stop) {
+    std::atomic<unsigned> calls(0);
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.func = NULL;
+    // Only the first evaluation is within the error, wherever it is.
+    parameters.func_ptr = [&calls](const double *, size_t) {
+        return calls++ == 0 ? 0.0 : 1000.0;
+    };
+    parameters.variables = 10;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.passes = 8;
+    parameters.threads = 4;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == 0.0);
+    // A full run makes 1200 calls. The threads may each have started a few
+    // more evaluations before they saw the stop.
+    BOOST_TEST(result.calls < 50);
+    BOOST_TEST(calls == result.calls);
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_one_pass_parallel) {
+    std::mutex mutex;
+    std::set<std::thread::id> ids;
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.func = NULL;
+    parameters.func_ptr = [&mutex, &ids](const double *x, size_t n) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> lock(mutex);
+        ids.insert(std::this_thread::get_id());
+        return Fit::sphere_ptr(x, n);
+    };
+    parameters.variables = 4;
+    parameters.lo = {-100.0};
+    parameters.hi = {100.0};
+    parameters.domains = {};
+    parameters.error = 0.1;
+    parameters.passes = 1;
+    parameters.threads = 4;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto result = fit.optimize();
+    BOOST_TEST(result.lowest == Fit::sphere(result.best));
+    // The points of each sweep are shared out even with a single pass.
+    BOOST_TEST(ids.size() > 1);
+}
+
+// A spawned model is the usual reason for a single pass, so its
+// evaluations must run side by side too: the log shows them overlapping.
+BOOST_AUTO_TEST_CASE(test_grid_one_pass_parallel_external) {
+    std::string dir = std::filesystem::temp_directory_path().string();
+    std::string script = dir + "/fit_slow_" + std::to_string(getpid());
+    std::string log = dir + "/fit_slow_log_" + std::to_string(getpid());
+    {
+        std::ofstream out(script);
+        out << "#!/bin/sh\nsleep 0.1\necho 1\n";
+    }
+    std::filesystem::permissions(script, std::filesystem::perms::owner_all);
+    std::remove(log.c_str());
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "external";
+    parameters.command = script;
+    parameters.variables = 2;
+    parameters.lo = {-1.0};
+    parameters.hi = {1.0};
+    parameters.domains = {};
+    parameters.divisions = {3};
+    parameters.error = -1.0;
+    parameters.generations = 1;
+    parameters.passes = 1;
+    parameters.threads = 4;
+    parameters.log = log;
+    parameters.verbose = false;
+    make_domains(parameters);
+    {
+        Fit::Optimization fit(parameters);
+        fit.optimize();
+    }
+    auto records = Fit::read_log(log);
+    BOOST_TEST(records.size() > 4u);
+    // Rows of one batch share their times, so only separate starts count.
+    bool overlap = false;
+    for (auto &a : records)
+        for (auto &b : records)
+            overlap = overlap ||
+                      (a.time < b.time && b.time < a.time + a.wall);
+    BOOST_TEST(overlap);
+    std::remove(script.c_str());
+    std::remove(log.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_philox_known_answers) {
+    // From the Random123 known answer tests for philox4x32_10.
+    Fit::philox zero(0);
+    auto r = zero({0, 0, 0, 0});
+    BOOST_TEST(r[0] == 0x6627e8d5u);
+    BOOST_TEST(r[1] == 0xe169c58du);
+    BOOST_TEST(r[2] == 0xbc57ac4cu);
+    BOOST_TEST(r[3] == 0x9b00dbd8u);
+    Fit::philox ones(0xffffffffffffffffull);
+    r = ones({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff});
+    BOOST_TEST(r[0] == 0x408f276du);
+    BOOST_TEST(r[1] == 0x41c83b0eu);
+    BOOST_TEST(r[2] == 0xa20bc7c6u);
+    BOOST_TEST(r[3] == 0x6d5451fdu);
+    Fit::philox pi(0x299f31d0a4093822ull);
+    r = pi({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344});
+    BOOST_TEST(r[0] == 0xd16cfe09u);
+    BOOST_TEST(r[1] == 0x94fdccebu);
+    BOOST_TEST(r[2] == 0x5001e420u);
+    BOOST_TEST(r[3] == 0x24126ea1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_seed_independent_of_threads) {
+    Fit::Parameters parameters;
+    parameters.func_name = "rastrigin";
+    parameters.func = Fit::rastrigin;
+    parameters.variables = 5;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    // Nothing is within the error, so every candidate is evaluated.
+    parameters.error = -1.0;
+    parameters.iterations = 2000;
+    parameters.passes = 3;
+    parameters.seed = 42;
+    parameters.verbose = false;
+    make_domains(parameters);
+    for (std::string method : {"random", "grid"}) {
+        parameters.method = method;
+        parameters.threads = 1;
+        auto one = Fit::Optimization(parameters).optimize();
+        parameters.threads = 4;
+        auto four = Fit::Optimization(parameters).optimize();
+        BOOST_TEST(one.lowest == four.lowest);
+        BOOST_TEST(one.best == four.best);
+        BOOST_TEST(one.calls == four.calls);
+    }
+    parameters.method = "random";
+    parameters.seed = 43;
+    auto other = Fit::Optimization(parameters).optimize();
+    parameters.seed = 42;
+    auto same = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(other.best != same.best);
+}
+
+BOOST_AUTO_TEST_CASE(test_seed_repeated_optimize) {
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.variables = 3;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.iterations = 50;
+    parameters.verbose = false;
+    // 0 is a seed like any other.
+    parameters.seed = 0;
+    make_domains(parameters);
+    Fit::Optimization fit(parameters);
+    auto first = fit.optimize();
+    auto second = fit.optimize();
+    // Another call on the same object draws new candidates, and a new
+    // object with the same seed draws the first call's again.
+    BOOST_TEST(first.best != second.best);
+    BOOST_TEST(Fit::Optimization(parameters).optimize().best == first.best);
+    for (std::string method : {"nms", "gradient"}) {
+        parameters.method = method;
+        parameters.dx_name = "sphere_dx";
+        parameters.dx = Fit::sphere_dx;
+        parameters.iterations = 1;
+        Fit::Optimization start(parameters);
+        BOOST_TEST(start.optimize().best != start.optimize().best);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_eval_cache) {
+    std::atomic<unsigned> calls(0);
+    Fit::eval_cache cache(1 << 20, 2);
+    // Holds the first evaluation until the other three threads are waiting
+    // for it.
+    Fit::opt_func_ptr slow = [&calls, &cache](const double *x, size_t n) {
+        calls++;
+        while (cache.hits() < 3)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return Fit::sphere_ptr(x, n);
+    };
+    std::vector<double> x = {1.0, 2.0};
+    // Threads asking for the same point together share one evaluation.
+    std::vector<std::thread> threads;
+    std::vector<double> ys(4);
+    for (int i = 0; i < 4; i++)
+        threads.emplace_back([&, i] { ys[i] = cache.evaluate(x.data(), 2, slow); });
+    for (auto &t : threads)
+        t.join();
+    BOOST_TEST(ys == std::vector<double>(4, 5.0));
+    BOOST_TEST(calls == 1);
+    BOOST_TEST(cache.hits() == 3);
+    BOOST_TEST(cache.misses() == 1);
+    double y = 0.0;
+    BOOST_TEST(cache.find(x.data(), 2, y));
+    BOOST_TEST(y == 5.0);
+    // A cache with room for a single entry keeps the newest.
+    Fit::eval_cache small(1, 2);
+    std::vector<double> z = {3.0, 4.0};
+    small.insert(x.data(), 2, 5.0);
+    small.insert(z.data(), 2, 25.0);
+    BOOST_TEST(!small.find(x.data(), 2, y));
+    BOOST_TEST(small.find(z.data(), 2, y));
+    BOOST_TEST(y == 25.0);
+    // Failures, as NaN or the penalty, are returned but not kept.
+    Fit::eval_cache failing(1 << 20, 2, 0.0, 1e6);
+    unsigned evaluations = 0;
+    auto timeout = [&evaluations](const double *, size_t) {
+        evaluations++;
+        return 1e6;
+    };
+    BOOST_TEST(failing.evaluate(x.data(), 2, timeout) == 1e6);
+    BOOST_TEST(failing.evaluate(x.data(), 2, timeout) == 1e6);
+    BOOST_TEST(evaluations == 2u);
+    failing.insert(z.data(), 2, NAN);
+    BOOST_TEST(!failing.find(z.data(), 2, y));
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_cache) {
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.variables = 4;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.generations = 5;
+    parameters.passes = 2;
+    parameters.seed = 1;
+    parameters.threads = 2;
+    parameters.verbose = false;
+    make_domains(parameters);
+    auto plain = Fit::Optimization(parameters).optimize();
+    parameters.cache = 16;
+    auto cached = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(cached.lowest == plain.lowest);
+    BOOST_TEST(cached.best == plain.best);
+    BOOST_TEST(cached.cache_hits + cached.cache_misses == cached.calls);
+    // Points in the same unit cube share a value.
+    parameters.cache_quantum = 1.0;
+    auto coarse = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(coarse.cache_hits + coarse.cache_misses == coarse.calls);
+    BOOST_TEST(coarse.cache_hits > 0u);
+    BOOST_TEST(coarse.cache_misses < plain.calls);
+}
+
+BOOST_AUTO_TEST_CASE(test_eval_store) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_store_test_" + std::to_string(getpid())))
+                           .string();
+    std::remove(path.c_str());
+    unsigned calls = 0;
+    Fit::opt_func_ptr counted = [&calls](const double *x, size_t n) {
+        calls++;
+        return Fit::sphere_ptr(x, n);
+    };
+    std::vector<double> x = {1.0, 2.0}, z = {3.0, 4.0};
+    {
+        Fit::eval_store store(path, "sphere");
+        BOOST_TEST(store.evaluate(x.data(), 2, counted) == 5.0);
+        BOOST_TEST(store.evaluate(x.data(), 2, counted) == 5.0);
+        BOOST_TEST(calls == 1);
+        BOOST_TEST(store.hits() == 1);
+        BOOST_TEST(store.misses() == 1);
+    }
+    // Another store on the same file, as another run would open it, finds
+    // the value, but a different model doesn't.
+    Fit::eval_store again(path, "sphere");
+    Fit::eval_store other(path, "sphere v2");
+    BOOST_TEST(again.evaluate(x.data(), 2, counted) == 5.0);
+    BOOST_TEST(calls == 1);
+    BOOST_TEST(other.evaluate(x.data(), 2, counted) == 5.0);
+    BOOST_TEST(calls == 2);
+    // Batches only evaluate the rows not stored yet.
+    std::vector<double> xs = {1.0, 2.0, 3.0, 4.0}, ys(2);
+    unsigned rows = 0;
+    Fit::opt_func_batch batch = [&rows](const double *xs, size_t m, size_t n,
+                                        double *ys) {
+        rows += m;
+        Fit::sphere_batch(xs, m, n, ys);
+    };
+    again.evaluate(xs.data(), 2, 2, ys.data(), batch);
+    BOOST_TEST(rows == 1);
+    BOOST_TEST(ys == std::vector<double>({5.0, 25.0}));
+    BOOST_TEST(again.evaluate(z.data(), 2, counted) == 25.0);
+    BOOST_TEST(calls == 2);
+    // A timeout's penalty and a NaN are not kept, so a later run with a
+    // longer timeout evaluates those points again.
+    std::vector<double> w = {5.0, 6.0}, vs = {7.0, 8.0, 9.0, 10.0};
+    {
+        Fit::eval_store timing_out(path, "slow", 1e6);
+        auto penalty = [](const double *, size_t) { return 1e6; };
+        BOOST_TEST(timing_out.evaluate(w.data(), 2, penalty) == 1e6);
+        Fit::opt_func_batch half = [](const double *xs, size_t m, size_t n,
+                                      double *ys) {
+            Fit::sphere_batch(xs, m, n, ys);
+            ys[0] = NAN;
+        };
+        timing_out.evaluate(vs.data(), 2, 2, ys.data(), half);
+    }
+    Fit::eval_store patient(path, "slow", 1e6);
+    calls = 0;
+    BOOST_TEST(patient.evaluate(w.data(), 2, counted) == 61.0);
+    BOOST_TEST(calls == 1);
+    rows = 0;
+    patient.evaluate(vs.data(), 2, 2, ys.data(), batch);
+    BOOST_TEST(rows == 1);
+    BOOST_TEST(ys == std::vector<double>({113.0, 181.0}));
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_random_store) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_random_store_" + std::to_string(getpid())))
+                           .string();
+    std::remove(path.c_str());
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.variables = 3;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.iterations = 300;
+    parameters.seed = 5;
+    parameters.threads = 2;
+    parameters.store = path;
+    parameters.verbose = false;
+    make_domains(parameters);
+    auto first = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(first.store_misses == 300u);
+    // The same seed draws the same points, which are all stored now.
+    auto second = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(second.store_hits == 300u);
+    BOOST_TEST(second.store_misses == 0u);
+    BOOST_TEST(second.lowest == first.lowest);
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_reuse_index) {
+    Fit::reuse_index index({{0.0, 10.0}, {-100.0, 100.0}}, 0.01);
+    std::vector<double> a = {5.0, 0.0}, b = {5.05, 1.5};
+    double y = 0.0;
+    BOOST_TEST(!index.find(a.data(), 2, y));
+    index.insert(a.data(), 2, 1.0);
+    index.insert(b.data(), 2, 2.0);
+    // Within 0.1 of a in the first variable and 2 in the second, and
+    // nearer to b.
+    std::vector<double> c = {5.04, 1.4};
+    BOOST_TEST(index.find(c.data(), 2, y));
+    BOOST_TEST(y == 2.0);
+    std::vector<double> d = {4.95, -1.0};
+    BOOST_TEST(index.find(d.data(), 2, y));
+    BOOST_TEST(y == 1.0);
+    std::vector<double> e = {5.0, 4.0};
+    BOOST_TEST(!index.find(e.data(), 2, y));
+    BOOST_TEST(index.hits() == 2u);
+}
+
+// A sorted sweep with ties, as grid makes, which the tree has to rebalance
+// under; every find must still agree with a search of all the points.
+BOOST_AUTO_TEST_CASE(test_reuse_index_sweep) {
+    Fit::reuse_index index({{0.0, 1.0}, {0.0, 1.0}, {0.0, 1.0}}, 0.004);
+    std::vector<std::vector<double>> points;
+    for (int i = 0; i < 20; i++)
+        for (int j = 0; j < 20; j++)
+            for (int k = 0; k < 20; k++) {
+                points.push_back({i / 20.0, j / 20.0, k / 400.0});
+                index.insert(points.back().data(), 3, points.size());
+            }
+    std::mt19937_64 gen(7);
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    for (int t = 0; t < 2000; t++) {
+        // Half the queries near a point, so that some are found.
+        std::vector<double> q = points[gen() % points.size()];
+        for (auto &v : q)
+            v += t % 2 ? 0.003 * (2 * u(gen) - 1) : u(gen);
+        double expected = 0.0, nearest = INFINITY;
+        for (size_t i = 0; i < points.size(); i++) {
+            double distance = 0.0;
+            bool within = true;
+            for (size_t j = 0; j < 3; j++) {
+                double d = q[j] - points[i][j];
+                within = within && std::fabs(d) <= 0.004;
+                distance += d * d;
+            }
+            if (within && distance < nearest) {
+                nearest = distance;
+                expected = i + 1;
+            }
+        }
+        double y = 0.0;
+        BOOST_TEST(index.find(q.data(), 3, y) == (nearest < INFINITY));
+        if (nearest < INFINITY)
+            BOOST_TEST(y == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_grid_reuse) {
+    std::atomic<unsigned> calls(0);
+    Fit::Parameters parameters;
+    parameters.method = "grid";
+    parameters.func_name = "sphere";
+    parameters.func = NULL;
+    parameters.func_ptr = [&calls](const double *x, size_t n) {
+        calls++;
+        return Fit::sphere_ptr(x, n);
+    };
+    parameters.variables = 3;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.divisions = {10};
+    parameters.generations = 8;
+    parameters.passes = 4;
+    parameters.seed = 3;
+    parameters.verbose = false;
+    make_domains(parameters);
+    auto plain = Fit::Optimization(parameters).optimize();
+    unsigned evaluated = calls;
+    calls = 0;
+    parameters.reuse_radius = 0.01;
+    auto reused = Fit::Optimization(parameters).optimize();
+    BOOST_TEST(reused.reused > 0u);
+    BOOST_TEST(calls + reused.reused == reused.calls);
+    BOOST_TEST(calls < evaluated);
+    BOOST_TEST(reused.lowest < 1.0);
+    BOOST_TEST(plain.lowest < 1.0);
+}
+
+// A reused value belongs to a neighbour, so the result must carry the
+// neighbour's point, not the candidate's.
+BOOST_AUTO_TEST_CASE(test_reuse_real_incumbent) {
+    for (std::string method : {"grid", "random", "nms"}) {
+        Fit::Parameters parameters;
+        parameters.method = method;
+        parameters.func_name = "sphere";
+        parameters.func = NULL;
+        parameters.func_ptr = Fit::sphere_ptr;
+        parameters.variables = 3;
+        parameters.lo = {-10.0};
+        parameters.hi = {10.0};
+        parameters.domains = {};
+        parameters.error = -1.0;
+        parameters.divisions = {10};
+        parameters.generations = 8;
+        parameters.passes = 4;
+        parameters.iterations = 200;
+        parameters.seed = 3;
+        parameters.verbose = false;
+        parameters.reuse_radius = 0.2;
+        make_domains(parameters);
+        // The second run starts from a fresh incumbent, but its neighbours
+        // are all from the first.
+        Fit::Optimization optimization(parameters);
+        optimization.optimize();
+        auto result = optimization.optimize();
+        BOOST_TEST_CONTEXT(method) {
+            BOOST_TEST(result.reused > 0u);
+            BOOST_TEST(Fit::sphere_ptr(result.best.data(), 3) ==
+                       result.lowest);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_checkpoint_file) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_checkpoint_" + std::to_string(getpid())))
+                           .string();
+    Fit::checkpoint c;
+    c.method = "grid";
+    c.function = "external ./model --fast";
+    c.variables = 2;
+    c.divisions = {5, 7};
+    c.passes = 3;
+    c.iterations = 100;
+    c.seed = 18446744073709551615ull;
+    c.invocation = 2;
+    c.position = 3;
+    c.calls = 1234;
+    c.lowest = 0.1;
+    c.best = {1.0 / 3.0, -2e-300};
+    c.domains = {{-1.0, M_PI}, {0.0, 1e10}};
+    c.save(path);
+    auto l = Fit::checkpoint::load(path);
+    BOOST_TEST(l.method == c.method);
+    BOOST_TEST(l.function == c.function);
+    BOOST_TEST(l.variables == c.variables);
+    BOOST_TEST(l.divisions == c.divisions);
+    BOOST_TEST(l.passes == c.passes);
+    BOOST_TEST(l.iterations == c.iterations);
+    BOOST_TEST(l.seed == c.seed);
+    BOOST_TEST(l.invocation == c.invocation);
+    BOOST_TEST(l.position == c.position);
+    BOOST_TEST(l.calls == c.calls);
+    BOOST_TEST(l.lowest == c.lowest);
+    BOOST_TEST(l.best == c.best);
+    BOOST_TEST((l.domains == c.domains));
+    std::remove(path.c_str());
+    BOOST_CHECK_THROW(Fit::checkpoint::load(path), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_interrupt_and_resume) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_resume_" + std::to_string(getpid())))
+                           .string();
+    for (std::string method : {"grid", "random"}) {
+        std::atomic<unsigned> calls(0);
+        unsigned stop_after = 0;
+        Fit::Parameters parameters;
+        parameters.method = method;
+        parameters.func_name = "rastrigin";
+        parameters.func = NULL;
+        parameters.func_ptr = [&](const double *x, size_t n) {
+            // Interrupts as a signal would, part way through.
+            if (++calls == stop_after)
+                Fit::interrupt();
+            return Fit::rastrigin_ptr(x, n);
+        };
+        parameters.variables = 4;
+        parameters.lo = {-10.0};
+        parameters.hi = {10.0};
+        parameters.domains = {};
+        parameters.error = -1.0;
+        parameters.iterations = 3000;
+        parameters.generations = 6;
+        parameters.passes = 3;
+        parameters.seed = 11;
+        parameters.threads = 1;
+        parameters.verbose = false;
+        make_domains(parameters);
+        auto whole = Fit::Optimization(parameters).optimize();
+        BOOST_TEST(!whole.interrupted);
+
+        calls = 0;
+        stop_after = whole.calls / 2;
+        parameters.checkpoint = path;
+        auto part = Fit::Optimization(parameters).optimize();
+        BOOST_TEST(part.interrupted);
+        BOOST_TEST(part.calls < whole.calls);
+        Fit::interrupt(0);
+
+        parameters.checkpoint = "";
+        parameters.resume = path;
+        parameters.seed = 0;
+        auto rest = Fit::Optimization(parameters).optimize();
+        BOOST_TEST(!rest.interrupted);
+        BOOST_TEST(rest.lowest == whole.lowest);
+        BOOST_TEST(rest.best == whole.best);
+        BOOST_TEST(rest.calls == whole.calls);
+        std::remove(path.c_str());
+    }
+}
+
+// A checkpoint counts the calls of earlier optimize()s too, and can only be
+// resumed with the function and parameters it was taken with.
+BOOST_AUTO_TEST_CASE(test_resume_checks) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_resume_checks_" + std::to_string(getpid())))
+                           .string();
+    std::atomic<unsigned> calls(0);
+    unsigned stop_after = 0;
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = NULL;
+    parameters.func_ptr = [&](const double *x, size_t n) {
+        if (++calls == stop_after)
+            Fit::interrupt();
+        return Fit::sphere_ptr(x, n);
+    };
+    parameters.variables = 3;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.iterations = 1000;
+    parameters.seed = 5;
+    parameters.threads = 1;
+    parameters.checkpoint = path;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Optimization optimization(parameters);
+    auto first = optimization.optimize();
+    stop_after = first.calls + 500;
+    auto second = optimization.optimize();
+    Fit::interrupt(0);
+    BOOST_TEST(second.interrupted);
+    auto c = Fit::checkpoint::load(path);
+    BOOST_TEST(c.invocation == 1u);
+    BOOST_TEST(c.calls == first.calls + c.position);
+
+    parameters.checkpoint = "";
+    parameters.resume = path;
+    auto changed = parameters;
+    changed.iterations = 2000;
+    BOOST_CHECK_THROW(Fit::Optimization{changed}, std::invalid_argument);
+    changed = parameters;
+    changed.func_name = "rastrigin";
+    BOOST_CHECK_THROW(Fit::Optimization{changed}, std::invalid_argument);
+    changed = parameters;
+    changed.variables = 4;
+    changed.domains = {};
+    make_domains(changed);
+    BOOST_CHECK_THROW(Fit::Optimization{changed}, std::invalid_argument);
+    changed = parameters;
+    changed.method = "grid";
+    BOOST_CHECK_THROW(Fit::Optimization{changed}, std::invalid_argument);
+    BOOST_CHECK_NO_THROW(Fit::Optimization{parameters});
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_eval_log) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_eval_log_" + std::to_string(getpid())))
+                           .string();
+    std::remove(path.c_str());
+    {
+        // More rows per thread than a ring holds, so the threads have to
+        // wait for the writer now and then.
+        Fit::eval_log log(path, 2);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < 3; t++) {
+            threads.emplace_back([&log, t] {
+                for (unsigned i = 0; i < 50000; i++) {
+                    double x[2] = {(double)t, (double)i};
+                    auto now = Fit::eval_log::clock::now();
+                    log.add(x, t * 100000.0 + i, now, now);
+                }
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+    }
+    auto records = Fit::read_log(path);
+    BOOST_TEST(records.size() == 150000u);
+    std::vector<unsigned> next(3, 0);
+    bool in_order = true;
+    for (auto &r : records) {
+        unsigned t = r.x[0], i = r.x[1];
+        in_order = in_order && r.y == t * 100000.0 + i && i == next[t]++ &&
+                   r.wall == 0;
+    }
+    BOOST_TEST(in_order);
+    BOOST_TEST(next == std::vector<unsigned>(3, 50000));
+    BOOST_CHECK_THROW(Fit::eval_log(path, 3), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+// A run killed while writing a block leaves part of it, which reading
+// stops at and appending cuts off.
+BOOST_AUTO_TEST_CASE(test_eval_log_torn_block) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_torn_log_" + std::to_string(getpid())))
+                           .string();
+    std::remove(path.c_str());
+    auto write_rows = [&](double first) {
+        Fit::eval_log log(path, 2);
+        for (unsigned i = 0; i < 10; i++) {
+            double x[2] = {first + i, 0.0};
+            auto now = Fit::eval_log::clock::now();
+            log.add(x, first + i, now, now);
+        }
+    };
+    write_rows(0.0);
+    auto whole = std::filesystem::file_size(path);
+    for (uint64_t rows : {uint64_t(3), uint64_t(1) << 60}) {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write((const char *)&rows, sizeof rows);
+        out.write("partial", 7);
+        out.close();
+        BOOST_TEST(Fit::read_log(path).size() == 10u);
+        std::filesystem::resize_file(path, whole);
+    }
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        uint64_t rows = 3;
+        out.write((const char *)&rows, sizeof rows);
+        out.write("partial", 7);
+    }
+    write_rows(10.0);
+    auto records = Fit::read_log(path);
+    BOOST_TEST(records.size() == 20u);
+    bool in_order = true;
+    for (size_t i = 0; i < records.size(); i++)
+        in_order = in_order && records[i].y == i && records[i].x[0] == i;
+    BOOST_TEST(in_order);
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_random_log) {
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("fit_random_log_" + std::to_string(getpid())))
+                           .string();
+    std::remove(path.c_str());
+    Fit::Parameters parameters;
+    parameters.method = "random";
+    parameters.func_name = "sphere";
+    parameters.func = Fit::sphere;
+    parameters.variables = 3;
+    parameters.lo = {-10.0};
+    parameters.hi = {10.0};
+    parameters.domains = {};
+    parameters.error = -1.0;
+    parameters.iterations = 300;
+    parameters.threads = 2;
+    parameters.log = path;
+    parameters.verbose = false;
+    make_domains(parameters);
+    Fit::Result result;
+    {
+        Fit::Optimization o(parameters);
+        result = o.optimize();
+    }
+    auto records = Fit::read_log(path);
+    BOOST_TEST(records.size() == result.calls);
+    bool values = true;
+    double lowest = INFINITY;
+    for (auto &r : records) {
+        values = values && r.x.size() == 3 && r.y == Fit::sphere(r.x);
+        lowest = std::min(lowest, r.y);
+    }
+    BOOST_TEST(values);
+    BOOST_TEST(lowest == result.lowest);
+    std::remove(path.c_str());
+}